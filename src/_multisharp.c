@@ -4,16 +4,20 @@
 
 #include <omp.h>
 #include "gdal.h"
+#include "cpl_conv.h"
 
 // include stuff
 #include "dtype.h"
 #include "usage.h"
 #include "alloc.h"
+#include "bandplan.h"
+#include "mask.h"
 #include "read.h"
 #include "pca.h"
 #include "resmerge.h"
 #include "spectralfit.h"
 #include "write.h"
+#include "stream.h"
 
 
 
@@ -22,7 +26,10 @@ int main( int argc, char *argv[] ){
 args_t args;
 img_t *images = NULL;
 table_t bandlist;
+bandplan_t plan;
+mask_t mask;
 time_t TIME;
+char gdal_threads[STRLEN];
 int i;
 
   
@@ -33,6 +40,12 @@ int i;
 
   GDALAllRegister();
 
+  // multi-threaded decoding, if the driver supports it
+  if (CPLGetConfigOption("GDAL_NUM_THREADS", NULL) == NULL){
+    snprintf(gdal_threads, sizeof(gdal_threads), "%d", args.nio);
+    CPLSetConfigOption("GDAL_NUM_THREADS", gdal_threads);
+  }
+
   alloc((void**)&images, IMGLEN, sizeof(img_t));
 
   omp_set_num_threads(args.ncpu);
@@ -40,21 +53,40 @@ int i;
   // read input  
   bandlist = read_table(args.f_bands, false, true);
 
-  read_dataset(images, &bandlist, &args);
+  compile_bandplan(&bandlist, &plan);
+
+  if (args.memory > 0){
+
+    stream_multisharp(images, &plan, &args);
+
+  } else {
+
+    read_dataset(images, &plan, &args);
+
+    if (args.decimate > 1 && strcmp(args.f_pca_load, "NULL") == 0){
+      read_decimated(images, &plan, &args);
+    }
+
+    pca(images, &mask, &args);
+
+    write_pca(images, &args);
 
-  pca(images, &args);
+    resolution_merge(images, &mask, &plan, &args);
 
-  write_pca(images, &args);
+    if (!args.fused) spectral_fit(images, &mask, &plan, &args);
 
-  resolution_merge(images, &args);
+    write_output(images, &plan, &args);
 
-  spectral_fit(images, &bandlist, &args);
+    free_mask(&mask);
 
-  write_output(images, &bandlist, &args);
+  }
 
-  for (i=0; i<IMGLEN; i++) free_2D((void**)images[i].data, images[i].meta.dim.band);
+  for (i=0; i<IMGLEN; i++){
+    if (images[i].data != NULL) free_2D((void**)images[i].data, images[i].meta.dim.band);
+  }
   free((void*)images);
   free_table(&bandlist);
+  free_bandplan(&plan);
 
   proctime_print("Total time", TIME);
 
@@ -0,0 +1,169 @@
+/**+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+This file is part of FORCE - Framework for Operational Radiometric 
+Correction for Environmental monitoring.
+
+Copyright (C) 2013-2022 David Frantz
+
+FORCE is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+FORCE is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with FORCE.  If not, see <http://www.gnu.org/licenses/>.
+
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+
+/**+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+This file contains functions for routing bands through the processing 
+chain
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+
+
+#include "bandplan.h"
+
+
+/** Compile band plan
++++ This function translates the band list into index arrays, such that
++++ reading, spectral fit and writing do not need to look up usage codes.
++++ Usage codes: 1 highres, 2 lowres, 0 spectral prediction, 3 synthesized
++++ wavelength (no input band), -1 ignored. The optional column 'file' 
++++ gives the input file of each band (1-based, in the order of the input
++++ files), it defaults to 1.
+--- bandlist: band list
+--- plan:     band plan (returned)
++++ Return:   SUCCESS/FAILURE
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int compile_bandplan(table_t *bandlist, bandplan_t *plan){
+int b, use, band, file, b_highres, b_lowres, b_spectral, b_in, b_out;
+int col_use, col_band, col_wavelength, col_file;
+double wavelength;
+
+
+  if ((col_use  = find_table_col(bandlist, "use")) < 0){
+    printf("there is no column 'use' in csv-file\n");
+    exit(FAILURE);
+  }
+  if ((col_band = find_table_col(bandlist, "band")) < 0){
+    printf("there is no column 'band' in csv-file\n");
+    exit(FAILURE);
+  }
+  if ((col_wavelength = find_table_col(bandlist, "wavelength")) < 0){
+    printf("there is no column 'wavelength' in csv-file\n");
+    exit(FAILURE);
+  }
+
+  // optional, all bands from one file if not given
+  col_file = find_table_col(bandlist, "file");
+
+  memset(plan, 0, sizeof(bandplan_t));
+  plan->nodata_band = -1;
+
+  for (b=0; b<bandlist->nrow; b++){
+
+    use  = (int)bandlist->data[b][col_use];
+    file = (col_file < 0) ? 1 : (int)bandlist->data[b][col_file];
+
+    if (file < 1 || file > MAXFILE){
+      printf("file %d in bandlist is out of range (1-%d)\n", file, MAXFILE);
+      exit(FAILURE);
+    }
+
+    if (use != 3 && file > plan->n_file) plan->n_file = file;
+
+    if (use == 1) plan->n_highres++;
+    if (use == 2) plan->n_lowres++;
+    if (use == 0 || use == 3) plan->n_spectral++;
+    if (use != 3) plan->n_input++;
+
+    if (use != 3 && plan->nodata_band < 0){
+      plan->nodata_band = (int)bandlist->data[b][col_band];
+      plan->nodata_file = file-1;
+    }
+
+  }
+
+  plan->nb_in  = plan->n_highres + plan->n_lowres;
+  plan->nb_out = plan->nb_in + plan->n_spectral;
+
+  alloc((void**)&plan->file_input,     plan->n_file,   sizeof(int));
+  alloc((void**)&plan->highres_band,   plan->n_highres, sizeof(int));
+  alloc((void**)&plan->highres_file,   plan->n_highres, sizeof(int));
+  alloc((void**)&plan->lowres_band,    plan->n_lowres,  sizeof(int));
+  alloc((void**)&plan->lowres_file,    plan->n_lowres,  sizeof(int));
+  alloc((void**)&plan->in_image,       plan->nb_in,  sizeof(int));
+  alloc((void**)&plan->in_index,       plan->nb_in,  sizeof(int));
+  alloc((void**)&plan->in_wavelength,  plan->nb_in,  sizeof(double));
+  alloc((void**)&plan->out_image,      plan->nb_out, sizeof(int));
+  alloc((void**)&plan->out_index,      plan->nb_out, sizeof(int));
+  alloc((void**)&plan->out_wavelength, plan->nb_out, sizeof(double));
+
+  plan->min_wavelength = DBL_MAX;
+  plan->max_wavelength = DBL_MIN;
+
+  for (b=0, b_highres=0, b_lowres=0, b_spectral=0, b_in=0, b_out=0; b<bandlist->nrow; b++){
+
+    use  = (int)bandlist->data[b][col_use];
+    band = (int)bandlist->data[b][col_band];
+    file = (col_file < 0) ? 0 : (int)bandlist->data[b][col_file] - 1;
+    wavelength = bandlist->data[b][col_wavelength];
+
+    if (use != 3) plan->file_input[file]++;
+
+    if (use == 1){
+      plan->highres_file[b_highres] = file;
+      plan->highres_band[b_highres] = band;
+      plan->in_image[b_in] = plan->out_image[b_out] = HIGHRES;
+      plan->in_index[b_in] = plan->out_index[b_out] = b_highres++;
+      plan->in_wavelength[b_in++] = plan->out_wavelength[b_out++] = wavelength;
+    } else if (use == 2){
+      plan->lowres_file[b_lowres] = file;
+      plan->lowres_band[b_lowres] = band;
+      plan->in_image[b_in] = plan->out_image[b_out] = SHARPENED;
+      plan->in_index[b_in] = plan->out_index[b_out] = b_lowres++;
+      plan->in_wavelength[b_in++] = plan->out_wavelength[b_out++] = wavelength;
+    } else if (use == 0 || use == 3){
+      plan->out_image[b_out] = SPECTRALFIT;
+      plan->out_index[b_out] = b_spectral++;
+      plan->out_wavelength[b_out++] = wavelength;
+    } else {
+      continue;
+    }
+
+    if (wavelength < plan->min_wavelength) plan->min_wavelength = wavelength;
+    if (wavelength > plan->max_wavelength) plan->max_wavelength = wavelength;
+
+  }
+
+  return SUCCESS;
+}
+
+
+/** Free band plan
+--- plan:   band plan
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void free_bandplan(bandplan_t *plan){
+
+
+  free((void*)plan->file_input);
+  free((void*)plan->highres_band);
+  free((void*)plan->highres_file);
+  free((void*)plan->lowres_band);
+  free((void*)plan->lowres_file);
+  free((void*)plan->in_image);
+  free((void*)plan->in_index);
+  free((void*)plan->in_wavelength);
+  free((void*)plan->out_image);
+  free((void*)plan->out_index);
+  free((void*)plan->out_wavelength);
+
+  return;
+}
+
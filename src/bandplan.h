@@ -0,0 +1,78 @@
+/**+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+This file is part of FORCE - Framework for Operational Radiometric 
+Correction for Environmental monitoring.
+
+Copyright (C) 2013-2022 David Frantz
+
+FORCE is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+FORCE is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with FORCE.  If not, see <http://www.gnu.org/licenses/>.
+
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+
+/**+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+Band plan header
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+
+
+#ifndef BANDPLAN_H
+#define BANDPLAN_H
+
+#include <stdio.h>   // core input and output functions
+#include <stdlib.h>  // standard general utilities library
+#include <stdbool.h> // boolean data type
+#include <float.h>   // macro constants of the floating-point library
+
+#include "dtype.h"
+#include "alloc.h"
+#include "table.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+  int n_highres;          // number of highres bands (usage code 1)
+  int n_lowres;           // number of lowres bands (usage code 2)
+  int n_spectral;         // number of predicted and synthesized bands (0, 3)
+  int n_input;            // number of bands in input images (all but 3)
+  int n_file;             // number of input files referenced
+  int *file_input;        // number of bands in each input file
+  int nodata_band;        // input band to take the nodata value from
+  int nodata_file;        // input file of nodata band
+  int *highres_band;      // input band of each highres band
+  int *highres_file;      // input file of each highres band
+  int *lowres_band;       // input band of each lowres band
+  int *lowres_file;       // input file of each lowres band
+  int nb_in;              // number of spectral fit inputs (1, 2)
+  int *in_image;          // image of each input (HIGHRES, SHARPENED)
+  int *in_index;          // band of each input within its image
+  double *in_wavelength;  // wavelength of each input
+  int nb_out;             // number of output bands (0, 1, 2, 3)
+  int *out_image;         // image of each output band, in table order
+  int *out_index;         // band of each output within its image
+  double *out_wavelength; // wavelength of each output
+  double min_wavelength;  // wavelength range of spectral fit
+  double max_wavelength;
+} bandplan_t;
+
+int compile_bandplan(table_t *bandlist, bandplan_t *plan);
+void free_bandplan(bandplan_t *plan);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
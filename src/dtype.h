@@ -7,25 +7,42 @@
 extern "C" {
 #endif
 
-enum { STRLEN = 1024, LONGSTRLEN = 65536, TRANSFORMLEN = 6 };
+enum { STRLEN = 1024, LONGSTRLEN = 65536, TRANSFORMLEN = 6, MAXFILE = 16 };
 
 enum { SUCCESS = 0, FAILURE = 1 };
 
-enum { HIGHRES, LOWRES, PCA, SHARPENED, SPECTRALFIT, NODATA, IMGLEN };
+enum { HIGHRES, LOWRES, PCA, SHARPENED, SPECTRALFIT, DECIMATED, IMGLEN };
+
+enum { SOLVER_SVD, SOLVER_GRAM, SOLVER_LENGTH };
 
 typedef struct {
   int n;
   char f_input[STRLEN];
+  int n_file;
+  char f_file[MAXFILE][STRLEN];
   char f_bands[STRLEN];
   char f_output[STRLEN];
   char f_pca[STRLEN];
+  char f_pca_save[STRLEN];
+  char f_pca_load[STRLEN];
   char format[STRLEN];
   int ncpu;
+  int nio;
   float minvar;
   int radius;
+  int solver;
+  int check;
+  int tile;
+  int grid;
+  int lowres;
+  float homogeneity;
   int sample;
+  int decimate;
   int order;
   int nbreak;
+  int partial;
+  int fused;
+  int memory;
 } args_t;
 
 typedef struct {
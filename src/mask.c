@@ -0,0 +1,171 @@
+/**+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+This file is part of FORCE - Framework for Operational Radiometric 
+Correction for Environmental monitoring.
+
+Copyright (C) 2013-2022 David Frantz
+
+FORCE is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+FORCE is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with FORCE.  If not, see <http://www.gnu.org/licenses/>.
+
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+
+/**+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+This file contains functions for the packed validity mask
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+
+
+#include "mask.h"
+
+
+/** Allocate validity mask
++++ This function allocates a validity mask, all pixels are invalid.
+--- mask:   validity mask (returned)
+--- cell:   number of pixels
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void alloc_mask(mask_t *mask, int cell){
+
+
+  mask->cell  = cell;
+  mask->nword = (cell + MASK_WORD - 1) / MASK_WORD;
+
+  alloc((void**)&mask->word, mask->nword, sizeof(uint64_t));
+
+  return;
+}
+
+
+/** Free validity mask
+--- mask:   validity mask
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void free_mask(mask_t *mask){
+
+
+  if (mask->word != NULL) free((void*)mask->word);
+  mask->word  = NULL;
+  mask->nword = 0;
+  mask->cell  = 0;
+
+  return;
+}
+
+
+/** Validity mask from bands
++++ This function flags pixels as valid if none of the bands is nodata. 
++++ The nodata value is compared with the same relative tolerance as in
++++ fequal, such that all validity tests agree; the test is inlined to be
++++ vectorized. The comparison runs over 64 pixels at a time, and is 
++++ packed into one word.
+--- mask:   validity mask (allocated, returned)
+--- data:   bands
+--- nb:     number of bands
+--- nodata: nodata value
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void mask_from_bands(mask_t *mask, float **data, int nb, float nodata){
+int w, b, k, p0, n;
+unsigned char invalid[MASK_WORD];
+const float *d = NULL;
+float abs_nodata = fabsf(nodata);
+uint64_t bits;
+
+
+  #pragma omp parallel for private(b,k,p0,n,invalid,d,bits) shared(mask,data,nb,nodata,abs_nodata) schedule(static) default(none)
+  for (w=0; w<mask->nword; w++){
+
+    p0 = w*MASK_WORD;
+    n  = (p0+MASK_WORD > mask->cell) ? mask->cell-p0 : MASK_WORD;
+
+    for (k=0; k<MASK_WORD; k++) invalid[k] = 0;
+
+    for (b=0; b<nb; b++){
+      d = data[b] + p0;
+      #pragma omp simd
+      for (k=0; k<n; k++) invalid[k] |= (fabsf(d[k]-nodata) <= fmaxf(fabsf(d[k]), abs_nodata)*FLT_EPSILON);
+    }
+
+    for (k=0, bits=0; k<n; k++) bits |= (uint64_t)(invalid[k] == 0) << k;
+
+    mask->word[w] = bits;
+
+  }
+
+  return;
+}
+
+
+/** Flag pixel as invalid
++++ This function clears the bit of one pixel. Neighboring pixels share 
++++ the word, thus the update is atomic.
+--- mask:   validity mask
+--- p:      pixel
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void mask_clear(mask_t *mask, int p){
+uint64_t keep = ~((uint64_t)1 << (p & 63));
+
+
+  #pragma omp atomic
+  mask->word[p >> 6] &= keep;
+
+  return;
+}
+
+
+/** Any valid pixel?
++++ This function tests whether there is any valid pixel in a contiguous 
++++ range of pixels. Full words are tested at once.
+--- mask:   validity mask
+--- p0:     first pixel
+--- np:     number of pixels
++++ Return: true if there is a valid pixel
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+bool mask_any(const mask_t *mask, int p0, int np){
+int p = p0, p1 = p0 + np;
+
+
+  // leading pixels up to a word boundary
+  for (; p < p1 && (p & 63); p++){
+    if (MASK_VALID(mask, p)) return true;
+  }
+
+  // full words
+  for (; p + MASK_WORD <= p1; p += MASK_WORD){
+    if (mask->word[p >> 6] != 0) return true;
+  }
+
+  // trailing pixels
+  for (; p < p1; p++){
+    if (MASK_VALID(mask, p)) return true;
+  }
+
+  return false;
+}
+
+
+/** Number of valid pixels
+--- mask:   validity mask
++++ Return: number of valid pixels
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int mask_count(const mask_t *mask){
+int w, n = 0;
+
+
+  #pragma omp parallel for shared(mask) reduction(+: n) default(none)
+  for (w=0; w<mask->nword; w++) n += __builtin_popcountll(mask->word[w]);
+
+  return n;
+}
+
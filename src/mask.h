@@ -0,0 +1,70 @@
+/**+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+This file is part of FORCE - Framework for Operational Radiometric 
+Correction for Environmental monitoring.
+
+Copyright (C) 2013-2022 David Frantz
+
+FORCE is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+FORCE is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with FORCE.  If not, see <http://www.gnu.org/licenses/>.
+
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+
+/**+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+Validity mask header
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+
+
+#ifndef MASK_H
+#define MASK_H
+
+#include <stdio.h>   // core input and output functions
+#include <stdlib.h>  // standard general utilities library
+#include <stdbool.h> // boolean data type
+#include <stdint.h>  // fixed-width integer types
+#include <math.h>    // common mathematical functions
+#include <float.h>   // macro constants of the floating-point library
+
+#include "dtype.h"
+#include "alloc.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// pixels per mask word
+#define MASK_WORD 64
+
+// is pixel p valid?
+#define MASK_VALID(mask, p) (((mask)->word[(p) >> 6] >> ((p) & 63)) & 1)
+
+typedef struct {
+  int cell;        // number of pixels
+  int nword;       // number of words
+  uint64_t *word;  // bit p%64 of word p/64 is set if pixel p is valid
+} mask_t;
+
+void alloc_mask(mask_t *mask, int cell);
+void free_mask(mask_t *mask);
+void mask_from_bands(mask_t *mask, float **data, int nb, float nodata);
+void mask_clear(mask_t *mask, int p);
+bool mask_any(const mask_t *mask, int p0, int np);
+int mask_count(const mask_t *mask);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -32,315 +32,462 @@ This file contains functions for principal components analysis
 #include "gsl/gsl_blas.h"
 #include "gsl/gsl_eigen.h"
 
-
-/** Compute Principal Components
-+++ This function computes Principal Components. The IMGut data may be in-
-+++ complete, a nodata value must be given. The PCs can be truncated using
-+++ a percenatge of total variance.
---- images[HIGHRES].data:    input image
---- mask_:  mask image
---- images[HIGHRES].meta.dim.band:     number of bands
---- images[HIGHRES].meta.dim.cell:     number of cells
---- nodata: nodata value
---- minvar: amount of retained variance [0...1]
---- newgeo->dim.band:  number of PC bands (returned)
-+++ Return: PC rotated data 
+// number of pixels projected at once
+#define PCA_BLOCK 4096
+
+void project_block(img_t *images, mask_t *mask, const float *E, int numcomp, int p0, int np);
+void write_pca_model(char *fname, pca_model_t *model);
+void read_pca_model(char *fname, pca_model_t *model);
+
+
+/** Project a block of pixels
++++ This function projects a contiguous block of pixels onto the truncated
++++ eigenvectors. The band-major float arrays are used as they are, nodata
++++ pixels are projected, too, and masked afterwards. Blocks without any
++++ valid pixel are skipped.
+--- images: images
+--- mask:   validity mask
+--- E:      truncated eigenvectors, numcomp x band
+--- numcomp: number of components
+--- p0:     first pixel
+--- np:     number of pixels
++++ Return: void
 +++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
-int pca(img_t *images, args_t *args){
-int p, k, valid_cells = 0, b;
-double *mean = NULL;
-float totalvar = 0, cumvar = 0, pctvar;
-int numcomp = images[HIGHRES].meta.dim.band;
-gsl_matrix *GIMG = NULL;
-gsl_matrix *covm = NULL;
-gsl_matrix *evec = NULL;
-gsl_vector *eval = NULL;
-time_t TIME;
+void project_block(img_t *images, mask_t *mask, const float *E, int numcomp, int p0, int np){
+int b, c, p, nb = images[HIGHRES].meta.dim.band;
+const float *in = NULL;
+float *out = NULL, e, nodata = images[HIGHRES].meta.nodata;
 
 
+  if (!mask_any(mask, p0, np)){
+    for (c=0; c<numcomp; c++){
+      for (p=0; p<np; p++) images[PCA].data[c][p0+p] = nodata;
+    }
+    return;
+  }
 
+  for (c=0; c<numcomp; c++){
 
-  time(&TIME);
+    out = images[PCA].data[c] + p0;
 
-  printf("Starting Principal Component Analysis\n");
+    for (p=0; p<np; p++) out[p] = 0;
 
-  
-  memcpy(&images[NODATA].meta, &images[HIGHRES].meta, sizeof(meta_t));
-  images[NODATA].meta.dim.band = 1;
-  alloc_2D((void***)&images[NODATA].data, 1, images[NODATA].meta.dim.cell, sizeof(float));
+    for (b=0; b<nb; b++){
+      in = images[HIGHRES].data[b] + p0;
+      e  = E[c*nb+b];
+      #pragma omp simd
+      for (p=0; p<np; p++) out[p] += e*in[p];
+    }
 
-  // compile nodata image for computing PCA with valld data only
-  alloc((void**)&mean,   images[HIGHRES].meta.dim.band, sizeof(double));
+    for (p=0; p<np; p++){
+      if (!MASK_VALID(mask, p0+p)) out[p] = nodata;
+    }
 
-  proctime_print("allocating 1", TIME);
+  }
 
-  #pragma omp parallel private(b) shared(images) reduction(+: valid_cells) default(none)
-  {
+  return;
+}
 
-  #pragma omp for
-  for (p=0; p<images[HIGHRES].meta.dim.cell; p++){
 
-    for (b=0; b<images[HIGHRES].meta.dim.band; b++){
+/** Write PCA model
++++ This function writes the PCA model to a csv table, which can be read
++++ with read_table. There is one row per band, with the band mean, the
++++ eigenvalue of the component with the same index, the number of re-
++++ tained components, and the band's loadings of all eigenvectors, i.e. 
++++ column ev<c> holds eigenvector c. Values are written with full 
++++ precision, such that the projection can be reproduced exactly.
+--- fname:  file name
+--- model:  PCA model
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void write_pca_model(char *fname, pca_model_t *model){
+int b, c, nb = model->nb;
+FILE *fp = NULL;
 
-      if (fequal(images[HIGHRES].data[b][p], images[HIGHRES].meta.nodata)){
-        images[NODATA].data[0][p] = -10000.0;
-        break;
-      }
 
-    }
+  if ((fp = fopen(fname, "w")) == NULL){
+    printf("unable to open file %s\n", fname); 
+    exit(FAILURE);
+  }
 
-    if (!fequal(images[NODATA].data[0][p], -10000.0)){
-      images[NODATA].data[0][p] = 10000.0;
-      valid_cells++;
-    } 
+  fprintf(fp, "rowname,mean,eigenvalue,retained");
+  for (c=0; c<nb; c++) fprintf(fp, ",ev%d", c+1);
+  fprintf(fp, "\n");
 
+  for (b=0; b<nb; b++){
+    fprintf(fp, "band%d,%.17g,%.17g,%d", b+1, model->mean[b], model->eval[b], model->numcomp);
+    for (c=0; c<nb; c++) fprintf(fp, ",%.17g", model->evec[b*nb+c]);
+    fprintf(fp, "\n");
   }
 
-  }
+  fclose(fp);
 
-  #pragma omp parallel private(p) shared(images,mean,valid_cells)  default(none)
-  {
+  return;
+}
 
-  #pragma omp for
-  for (b=0; b<images[HIGHRES].meta.dim.band; b++){
-  
-    for (p=0; p<images[HIGHRES].meta.dim.cell; p++){
 
-      if (images[NODATA].data[0][p] < 0) continue;
+/** Read PCA model
++++ This function reads a PCA model that was written by write_pca_model.
++++ The model must have been computed from the same number of bands.
+--- fname:  file name
+--- model:  PCA model (returned)
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void read_pca_model(char *fname, pca_model_t *model){
+int b, c, nb = model->nb;
+int col_mean, col_eval, col_retained, col_evec;
+table_t table;
 
-      mean[b] += images[HIGHRES].data[b][p];
-      
-    }
 
-    mean[b] /= valid_cells;
-    //printf("mean band %d: %f\n", b, mean[b]);
+  table = read_table(fname, true, true);
+
+  col_mean     = find_table_col(&table, "mean");
+  col_eval     = find_table_col(&table, "eigenvalue");
+  col_retained = find_table_col(&table, "retained");
+  col_evec     = find_table_col(&table, "ev1");
 
+  if (col_mean < 0 || col_eval < 0 || col_retained < 0 || col_evec < 0){
+    printf("PCA model %s is malformed.\n", fname); 
+    exit(FAILURE);
   }
 
+  if (table.nrow != nb || table.ncol - col_evec < nb){
+    printf("PCA model %s does not fit: %d bands expected.\n", fname, nb); 
+    exit(FAILURE);
   }
 
+  model->numcomp = (int)table.data[0][col_retained];
 
+  if (model->numcomp < 1 || model->numcomp > nb){
+    printf("PCA model %s retains %d components, out of range.\n", fname, model->numcomp); 
+    exit(FAILURE);
+  }
 
-  proctime_print("NODATA & band means", TIME);
+  for (b=0; b<nb; b++){
+    model->mean[b] = table.data[b][col_mean];
+    model->eval[b] = table.data[b][col_eval];
+    for (c=0; c<nb; c++) model->evec[b*nb+c] = table.data[b][col_evec+c];
+  }
 
+  free_table(&table);
 
-  int *chunk_start = NULL;
-  int *chunk_size = NULL;
-  int target_chunk_size = 10000;
-  int n_chunk;
-  int chunk_number;
-  n_chunk = ceil((double)valid_cells / target_chunk_size);
+  return;
+}
 
 
-  alloc((void**)&chunk_start, n_chunk, sizeof(int));
-  alloc((void**)&chunk_size, n_chunk, sizeof(int));
+/** Initialize PCA model
+--- model:  PCA model (returned)
+--- nb:     number of bands
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void init_pca_model(pca_model_t *model, int nb){
 
-  for (p=0, k=0, chunk_number=0; p<images[HIGHRES].meta.dim.cell; p++){
 
-    if (k == target_chunk_size) k = 0;
+  model->nb = nb;
+  model->numcomp = nb;
+  model->n = 0;
 
-    if (images[NODATA].data[0][p] > 0){
-      if (k == 0) chunk_start[chunk_number] = p;
-      chunk_size[chunk_number] = ++k;
-      if (k == target_chunk_size) chunk_number++;
-    }
+  alloc((void**)&model->mean,     nb,    sizeof(double));
+  alloc((void**)&model->comoment, nb*nb, sizeof(double));
+  alloc((void**)&model->eval,     nb,    sizeof(double));
+  alloc((void**)&model->evec,     nb*nb, sizeof(double));
 
-  }
+  return;
+}
 
-  /**
-  for (chunk_number=0; chunk_number<n_chunk; chunk_number++){
-    printf("chunk_number %d, start: %d, size: %d\n", chunk_number, chunk_start[chunk_number], chunk_size[chunk_number]);
-  }
-  **/
 
-  proctime_print("chunk sizes", TIME);
+/** Free PCA model
+--- model:  PCA model
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void free_pca_model(pca_model_t *model){
 
 
-  //printf("number of cells %d, number of valid cells %d\n", images[HIGHRES].meta.dim.cell, valid_cells);
+  free((void*)model->mean);
+  free((void*)model->comoment);
+  free((void*)model->eval);
+  free((void*)model->evec);
 
-int sampled_cells;
-  // subsample
-  sampled_cells = valid_cells / args->sample;
-  
-  //printf("number of cells %d, number of sampled cells %d\n", images[HIGHRES].meta.dim.cell, sampled_cells);
+  return;
+}
 
 
-  // allocate GSL matrices for original and projected data
-  GIMG = gsl_matrix_alloc(sampled_cells, images[HIGHRES].meta.dim.band);
+/** Accumulate PCA statistics
++++ This function estimates the means and co-moment matrix of every s-th
++++ valid cell, and adds them to the model. Thus, the statistics can be 
++++ accumulated over several images, e.g. blocks of one image. The valid-
++++ ity mask is traversed word by word, such that runs of 64 invalid cells
++++ are skipped at once. Each thread samples its own part of the image, 
++++ the estimates are merged at the end.
+--- img:    image
+--- mask:   validity mask
+--- sample: sampling factor
+--- model:  PCA model (is updated)
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void pca_accumulate(img_t *img, mask_t *mask, int sample, pca_model_t *model){
+int w, p, k, b, t, nb = img->meta.dim.band;
+int nthread = omp_get_max_threads();
+double *x = NULL, **mx = NULL, **cm = NULL, *n = NULL;
+uint64_t bits;
 
 
-  // allocate covariance matrix, eigen-values and eigen-vectors
-  covm = gsl_matrix_calloc(images[HIGHRES].meta.dim.band, images[HIGHRES].meta.dim.band);
-  eval = gsl_vector_alloc(images[HIGHRES].meta.dim.band);
-  evec = gsl_matrix_alloc(images[HIGHRES].meta.dim.band, images[HIGHRES].meta.dim.band);
-
-int sample_counter = 0;
-  // center each band around mean
-  for (b=0; b<images[HIGHRES].meta.dim.band; b++){
-
-    for (p=0, sample_counter=1, k=0; p<images[HIGHRES].meta.dim.cell; p++){
-      if (images[NODATA].data[0][p] > 0){
-        if (sample_counter != args->sample){
-          sample_counter++;
-          continue;
-        }
-        gsl_matrix_set(GIMG, k++, b, images[HIGHRES].data[b][p]-mean[b]);
-        sample_counter = 1;
-      } 
+  // means and co-moments, per thread
+  alloc_2D((void***)&mx, nthread, nb,    sizeof(double));
+  alloc_2D((void***)&cm, nthread, nb*nb, sizeof(double));
+  alloc((void**)&n, nthread, sizeof(double));
+
+  #pragma omp parallel private(p,b,k,t,x,bits) shared(img,mask,sample,nb,mx,cm,n) default(none)
+  {
+
+  t = omp_get_thread_num();
+  alloc((void**)&x, nb, sizeof(double));
+  k = 0;
+
+  #pragma omp for schedule(static)
+  for (w=0; w<mask->nword; w++){
+
+    // valid cells of this word
+    for (bits=mask->word[w]; bits != 0; bits &= bits-1){
+
+      if (++k < sample) continue;
+      k = 0;
+
+      p = w*MASK_WORD + __builtin_ctzll(bits);
+
+      for (b=0; b<nb; b++) x[b] = img->data[b][p];
+
+      n[t]++;
+      comoment_recurrence(x, mx[t], cm[t], nb, n[t]);
+
     }
 
-    //printf("mean band %d: %f\n", b, mean[b]);
+  }
+
+  free((void*)x);
 
   }
-  
-  free((void*)mean);
 
-//printf("k: %d, sampled cells: %d\n", k, sampled_cells);
-  // compute covariance matrix and scale
-  gsl_blas_dgemm(CblasTrans, CblasNoTrans, 1.0, GIMG, GIMG, 0, covm);
+  // merge estimates of all threads, and add to model
+  for (t=0; t<nthread; t++){
+    comoment_merge(model->mean, model->comoment, &model->n, mx[t], cm[t], n[t], nb);
+  }
+
+  free_2D((void**)mx, nthread);
+  free_2D((void**)cm, nthread);
+  free((void*)n);
 
-//printf("computed covariance matrix\n");
-  gsl_matrix_scale(covm, 1.0/(double)(sampled_cells - 1));
-//printf("scaled covariance matrix\n");
+  return;
+}
+
+
+/** Solve PCA model
++++ This function computes eigenvalues and eigenvectors of the covariance 
++++ matrix, and decides how many components to keep, using the percentage
++++ of retained variance. If requested, the model is written to file. If
++++ a model file is given, the model is read instead, and the statistics
++++ are not needed.
+--- model:  PCA model (is updated)
+--- args:   arguments
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void pca_solve(pca_model_t *model, args_t *args){
+int b, bb, nb = model->nb;
+float totalvar = 0, cumvar = 0, pctvar;
+gsl_matrix *covm = NULL;
+gsl_matrix *evec = NULL;
+gsl_vector *eval = NULL;
+gsl_eigen_symmv_workspace *w = NULL;
+
+
+  // PCA model of a previous run, statistics are skipped
+  if (strcmp(args->f_pca_load, "NULL") != 0){
+    read_pca_model(args->f_pca_load, model);
+    printf("PCA model read from %s, %d components are retained\n", args->f_pca_load, model->numcomp);
+    return;
+  }
+
+  if (model->n < 2){
+    printf("too few valid cells for PCA (%.0f sampled).\n", model->n);
+    exit(FAILURE);
+  }
+
+  // allocate covariance matrix, eigen-values and eigen-vectors
+  covm = gsl_matrix_calloc(nb, nb);
+  eval = gsl_vector_alloc(nb);
+  evec = gsl_matrix_alloc(nb, nb);
+
+  // covariance matrix from co-moments (upper triangle)
+  for (b=0;  b<nb;  b++){
+  for (bb=b; bb<nb; bb++){
+    gsl_matrix_set(covm, b, bb, model->comoment[b*nb+bb] / (model->n - 1));
+    gsl_matrix_set(covm, bb, b, model->comoment[b*nb+bb] / (model->n - 1));
+  }
+  }
 
 
   /**
-  int bb;
   printf("Covariance Matrix:\n");
-  for (b=0;  b<images[HIGHRES].meta.dim.band;  b++){
-  for (bb=0; bb<images[HIGHRES].meta.dim.band; bb++){
+  for (b=0;  b<nb;  b++){
+  for (bb=0; bb<nb; bb++){
     printf("%8.2f ", gsl_matrix_get(covm,b,bb));
-    if (bb==images[HIGHRES].meta.dim.band-1) printf("\n");
+    if (bb==nb-1) printf("\n");
   }
   }
   **/
 
 
   // find eigen-values and eigen-vectors
-  gsl_eigen_symmv_workspace *w = gsl_eigen_symmv_alloc(images[HIGHRES].meta.dim.band);
+  w = gsl_eigen_symmv_alloc(nb);
   gsl_eigen_symmv(covm, eval, evec, w);
   gsl_eigen_symmv_free(w);
   gsl_eigen_symmv_sort(eval, evec, GSL_EIGEN_SORT_VAL_DESC);
 
-//printf("found eigen-values and eigen-vectors\n");
+  for (b=0; b<nb; b++){
+    model->eval[b] = gsl_vector_get(eval, b);
+    for (bb=0; bb<nb; bb++) model->evec[b*nb+bb] = gsl_matrix_get(evec, b, bb);
+  }
+
   /**
   printf("Eigen values:\n");
-  for (b=0; b<images[HIGHRES].meta.dim.band; b++) printf("%10.4f ", gsl_vector_get(eval,b));
+  for (b=0; b<nb; b++) printf("%10.4f ", model->eval[b]);
   printf("\n\nEigen Vector Matrix Values:\n");
-  for (b=0;  b<images[HIGHRES].meta.dim.band;  b++){
-  for (bb=0; bb<images[HIGHRES].meta.dim.band; bb++){
-    printf("%8.5f ", gsl_matrix_get(evec,b,bb));
-    if (bb==images[HIGHRES].meta.dim.band-1) printf("\n");
+  for (b=0;  b<nb;  b++){
+  for (bb=0; bb<nb; bb++){
+    printf("%8.5f ", model->evec[b*nb+bb]);
+    if (bb==nb-1) printf("\n");
   }
   }
   **/
 
+  gsl_vector_free(eval);
+  gsl_matrix_free(covm);
+  gsl_matrix_free(evec);
+
 
   // find how many components to keep
   printf("Cumulated percentage of variance:\n");
   if (args->minvar < 1){
-    for (b=0; b<images[HIGHRES].meta.dim.band; b++) totalvar += gsl_vector_get(eval,b);
-    for (b=0; b<images[HIGHRES].meta.dim.band; b++){
-      cumvar += gsl_vector_get(eval,b);
+    for (b=0; b<nb; b++) totalvar += model->eval[b];
+    for (b=0; b<nb; b++){
+      cumvar += model->eval[b];
       pctvar = cumvar/totalvar;
       printf("%5.2f%% ", pctvar*100);
       if (pctvar > args->minvar){
-        numcomp = b+1;
+        model->numcomp = b+1;
         break;
       }
     }
   } else {
-    numcomp = images[HIGHRES].meta.dim.band;
+    model->numcomp = nb;
   }
 
-  printf("\n%d components are retained\n", numcomp);
-
-
-  // allocate projected and truncated data
-  alloc_2D((void***)&images[PCA].data, numcomp, images[HIGHRES].meta.dim.cell, sizeof(float));
-//printf("alloc\n");
-  // project original data to principal components
-
-
-gsl_matrix *GIMG_chunk = NULL;
-gsl_matrix *GPCA_chunk = NULL;
-
-
-int pos_chunk, pos_image;
+  printf("\n%d components are retained\n", model->numcomp);
 
+  // write PCA model for reuse
+  if (strcmp(args->f_pca_save, "NULL") != 0){
+    write_pca_model(args->f_pca_save, model);
+  }
 
-  #pragma omp parallel private(p,b,GIMG_chunk,GPCA_chunk,pos_chunk) shared(images,numcomp,evec,n_chunk,chunk_start,chunk_size)  default(none)
-  {
+  return;
+}
 
-  #pragma omp for
-  for (chunk_number=0; chunk_number<n_chunk; chunk_number++){
 
+/** Project onto Principal Components
++++ This function projects the HIGHRES bands onto the retained components
++++ of the PCA model, block by block.
+--- images: images
+--- mask:   validity mask
+--- model:  PCA model
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void pca_project(img_t *images, mask_t *mask, pca_model_t *model){
+int k, b, n_block, nb = model->nb, numcomp = model->numcomp;
+float *E = NULL;
 
-    // allocate the chunk_number
-    GIMG_chunk = gsl_matrix_alloc(chunk_size[chunk_number], images[HIGHRES].meta.dim.band);
-    GPCA_chunk = gsl_matrix_alloc(chunk_size[chunk_number], images[HIGHRES].meta.dim.band);
 
-    //printf("chunk_number %d, size: %d\n", chunk_number, chunk_size[chunk_number]);
+  // allocate projected and truncated data
+  alloc_2D((void***)&images[PCA].data, numcomp, images[HIGHRES].meta.dim.cell, sizeof(float));
 
-    // copy data to chunk_number
-    for (p=chunk_start[chunk_number], pos_chunk=0; p<images[HIGHRES].meta.dim.cell; p++){
+  // truncated eigenvectors, numcomp x band
+  alloc((void**)&E, numcomp*nb, sizeof(float));
+  for (k=0; k<numcomp; k++){
+  for (b=0; b<nb; b++) E[k*nb+b] = (float)model->evec[b*nb+k];
+  }
 
-      if (pos_chunk == chunk_size[chunk_number]) break;
+  // project original data to principal components, block by block
+  n_block = (images[HIGHRES].meta.dim.cell + PCA_BLOCK - 1) / PCA_BLOCK;
 
-      if (images[NODATA].data[0][p] < 0) continue;
+  #pragma omp parallel for schedule(static) shared(images,mask,numcomp,E,n_block) default(none)
+  for (k=0; k<n_block; k++){
+    project_block(images, mask, E, numcomp, k*PCA_BLOCK, 
+      (k*PCA_BLOCK+PCA_BLOCK > images[HIGHRES].meta.dim.cell) ? images[HIGHRES].meta.dim.cell-k*PCA_BLOCK : PCA_BLOCK);
+  }
 
-      for (b=0; b<images[HIGHRES].meta.dim.band; b++) gsl_matrix_set(GIMG_chunk, pos_chunk, b, images[HIGHRES].data[b][p]);
-      pos_chunk++;
-    
-    }
+  free((void*)E);
 
-    // project the principal components
-    gsl_blas_dgemm(CblasNoTrans, CblasTrans, 1.0, GIMG_chunk, evec, 0.0, GPCA_chunk);
+  memcpy(&images[PCA].meta, &images[HIGHRES].meta, sizeof(meta_t));
+  images[PCA].meta.dim.band = numcomp;
 
-    // copy back to image
-    for (p=chunk_start[chunk_number], pos_chunk=0; p<images[HIGHRES].meta.dim.cell; p++){
+  return;
+}
 
-      if (pos_chunk == chunk_size[chunk_number]) break;
 
-      if (images[NODATA].data[0][p] < 0){ 
-        for (b=0; b<numcomp; b++)images[PCA].data[b][p] = images[HIGHRES].meta.nodata;
-      } else {
-        for (b=0; b<numcomp; b++)images[PCA].data[b][p] = gsl_matrix_get(GPCA_chunk, pos_chunk, b);
-        pos_chunk++;
-      }
+/** Compute Principal Components
++++ This function computes Principal Components. The input data may be in-
++++ complete, a nodata value must be given. The PCs can be truncated using
++++ a percentage of total variance. The statistics are estimated from the
++++ full-resolution or decimated HIGHRES bands, or the model is read from
++++ file.
+--- images: images
+--- mask:   validity mask (returned)
+--- args:   arguments
++++ Return: SUCCESS/FAILURE
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int pca(img_t *images, mask_t *mask, args_t *args){
+int nb = images[HIGHRES].meta.dim.band;
+pca_model_t model;
+mask_t decimated;
+time_t TIME;
 
-    }
 
-    // free the chunk_number
-    gsl_matrix_free(GIMG_chunk);
-    gsl_matrix_free(GPCA_chunk);
+  time(&TIME);
 
-  }
+  printf("Starting Principal Component Analysis\n");
 
+  
+  // validity mask for computing PCA with valid data only
+  alloc_mask(mask, images[HIGHRES].meta.dim.cell);
+  mask_from_bands(mask, images[HIGHRES].data, nb, images[HIGHRES].meta.nodata);
+
+  init_pca_model(&model, nb);
+
+  // estimate means and covariance from the full-resolution or decimated
+  // data, unless the model is read from file
+  if (strcmp(args->f_pca_load, "NULL") != 0){
+    // statistics are skipped
+  } else if (images[DECIMATED].data != NULL){
+    alloc_mask(&decimated, images[DECIMATED].meta.dim.cell);
+    mask_from_bands(&decimated, images[DECIMATED].data, nb, images[DECIMATED].meta.nodata);
+    pca_accumulate(&images[DECIMATED], &decimated, 1, &model);
+    // decimated data is not needed anymore
+    free_mask(&decimated);
+    free_2D((void**)images[DECIMATED].data, images[DECIMATED].meta.dim.band);
+    images[DECIMATED].data = NULL;
+  } else {
+    pca_accumulate(&images[HIGHRES], mask, args->sample, &model);
   }
 
+  proctime_print("covariance", TIME);
 
-//printf("project\n");
+  pca_solve(&model, args);
 
-  // restructure data
-//printf("loop\n");
+  pca_project(images, mask, &model);
 
-
-  // clean
-  gsl_vector_free(eval);
-  gsl_matrix_free(covm);
-  gsl_matrix_free(evec);
-  gsl_matrix_free(GIMG);
-  //gsl_matrix_free(GPCA);
-  free((void*)chunk_start);
-  free((void*)chunk_size);
-//printf("free\n");
+  free_pca_model(&model);
 
   proctime_print("computing PCA", TIME);
 
-  memcpy(&images[PCA].meta, &images[HIGHRES].meta, sizeof(meta_t));
-  images[PCA].meta.dim.band = numcomp;
-
   return SUCCESS;
 }
 
@@ -31,17 +31,36 @@ PCA header
 #include <stdio.h>   // core input and output functions
 #include <stdlib.h>  // standard general utilities library
 #include <stdbool.h> // boolean data type
+#include <omp.h>     // multiprocessing
 
 #include "dtype.h"
 #include "alloc.h"
 #include "utils.h"
+#include "stats.h"
+#include "table.h"
+#include "mask.h"
 
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-int pca(img_t *images, args_t *args);
+typedef struct {
+  int nb;            // number of bands
+  int numcomp;       // number of retained components
+  double n;          // number of sampled cells
+  double *mean;      // band means
+  double *comoment;  // co-moment matrix, nb x nb (upper triangle)
+  double *eval;      // eigenvalues, sorted
+  double *evec;      // eigenvectors, sorted, nb x nb (columns)
+} pca_model_t;
+
+void init_pca_model(pca_model_t *model, int nb);
+void free_pca_model(pca_model_t *model);
+void pca_accumulate(img_t *img, mask_t *mask, int sample, pca_model_t *model);
+void pca_solve(pca_model_t *model, args_t *args);
+void pca_project(img_t *images, mask_t *mask, pca_model_t *model);
+int pca(img_t *images, mask_t *mask, args_t *args);
 
 #ifdef __cplusplus
 }
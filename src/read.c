@@ -1,110 +1,743 @@
 #include "read.h"
 
 
-int read_dataset(img_t *images, table_t *bandlist, args_t *args){
-GDALDatasetH dataset = NULL;
-GDALRasterBandH band = NULL;
-int b, b_highres, b_lowres;
-int has_nodata, n_band;
-int col_use, col_band, col_wavelength;
-time_t TIME;
+void check_band(int band, int n_band);
+void aggregate_band(const float *fine, int row, int col, float nodata, int factor, float *coarse);
+bool same_grid(GDALDatasetH dataset, meta_t *meta);
+void read_window(GDALDatasetH dataset, char *fname, args_t *args, int nb, int *bands, float **data, int xoff, int yoff, int xsize, int ysize, int bx, int by);
+bool pixel_interleaved(GDALDatasetH dataset);
+void read_interleaved(GDALDatasetH dataset, char *fname, args_t *args, int nb, int *bands, float **data, int xoff, int yoff, int xsize, int ysize);
+void read_resampled(GDALDatasetH dataset, char *fname, args_t *args, int nb, int *bands, float **data, meta_t *meta, int r0, int nrow);
 
-  
-  time(&TIME);
 
-  printf("Starting Image Read\n")  ;
+/** Open input datasets
++++ This function opens the input images, checks the band list against 
++++ them, and fills the metadata of the HIGHRES and LOWRES images for the
++++ full scene. The grid is given by the image of the first HIGHRES band.
++++ All HIGHRES bands must be on this grid; LOWRES bands may be on this 
++++ grid, or on a coarser grid with the same extent. With -l, coarser 
++++ LOWRES images must match the native grid. No data is read.
+--- images: images
+--- plan:   band plan
+--- args:   arguments
++++ Return: dataset handles, one per input image
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+GDALDatasetH *open_dataset(img_t *images, bandplan_t *plan, args_t *args){
+GDALDatasetH *dataset = NULL;
+GDALRasterBandH band = NULL;
+int b, f, grid;
+int has_nodata, n_band;
+double geotran[TRANSFORMLEN], tol;
 
 
-  if ((dataset = GDALOpen(args->f_input, GA_ReadOnly)) == NULL){
-    printf("unable to open %s\n", args->f_input);
+  if (plan->n_file > args->n_file){
+    printf("bandlist refers to input image %d, but %d input images are given\n",
+      plan->n_file, args->n_file); 
     exit(FAILURE);
   }
 
-  if ((n_band = GDALGetRasterCount(dataset)) != bandlist->nrow){
-    printf("number of bands in bandlist (%d) and input image (%d) do not match\n",
-      bandlist->nrow, n_band); 
-    exit(FAILURE);
+  alloc((void**)&dataset, args->n_file, sizeof(GDALDatasetH));
+
+  for (f=0; f<args->n_file; f++){
+
+    if ((dataset[f] = GDALOpen(args->f_file[f], GA_ReadOnly)) == NULL){
+      printf("unable to open %s\n", args->f_file[f]);
+      exit(FAILURE);
+    }
+
+    n_band = GDALGetRasterCount(dataset[f]);
+
+    if (n_band != ((f < plan->n_file) ? plan->file_input[f] : 0)){
+      printf("number of input bands in bandlist (%d) and input image %s (%d) do not match\n",
+        (f < plan->n_file) ? plan->file_input[f] : 0, args->f_file[f], n_band); 
+      exit(FAILURE);
+    }
+
+    if (pixel_interleaved(dataset[f])){
+      printf("input image %s is pixel-interleaved, bands are read at once\n", args->f_file[f]);
+    }
+
   }
 
-  images[HIGHRES].meta.dim.col = GDALGetRasterXSize(dataset);
-  images[HIGHRES].meta.dim.row = GDALGetRasterYSize(dataset);
+  grid = plan->highres_file[0];
+
+  images[HIGHRES].meta.dim.col = GDALGetRasterXSize(dataset[grid]);
+  images[HIGHRES].meta.dim.row = GDALGetRasterYSize(dataset[grid]);
   images[HIGHRES].meta.dim.cell = images[HIGHRES].meta.dim.col * images[HIGHRES].meta.dim.row;
-  images[HIGHRES].meta.dim.band = 0;
+  images[HIGHRES].meta.dim.band = plan->n_highres;
 
-  GDALGetGeoTransform(dataset, images[HIGHRES].meta.transformation);
-  copy_string(images[HIGHRES].meta.projection, STRLEN, GDALGetProjectionRef(dataset));
-  images[HIGHRES].meta.datatype = GDALGetDataTypeByName(dataset);
+  GDALGetGeoTransform(dataset[grid], images[HIGHRES].meta.transformation);
+  copy_string(images[HIGHRES].meta.projection, STRLEN, GDALGetProjectionRef(dataset[grid]));
+  images[HIGHRES].meta.datatype = GDALGetDataTypeByName(dataset[grid]);
   
   memcpy(&images[LOWRES].meta, &images[HIGHRES].meta, sizeof(meta_t));
+  images[LOWRES].meta.dim.band = plan->n_lowres;
 
-  //print_table(bandlist, false, false);
+  // LOWRES bands on their native grid, factor x coarser
+  if (args->lowres > 1){
+    images[LOWRES].meta.dim.col = (images[HIGHRES].meta.dim.col + args->lowres - 1) / args->lowres;
+    images[LOWRES].meta.dim.row = (images[HIGHRES].meta.dim.row + args->lowres - 1) / args->lowres;
+    images[LOWRES].meta.dim.cell = images[LOWRES].meta.dim.col * images[LOWRES].meta.dim.row;
+    for (b=1; b<TRANSFORMLEN; b++){
+      if (b != 3) images[LOWRES].meta.transformation[b] *= args->lowres;
+    }
+  }
 
-  if ((col_use  = find_table_col(bandlist, "use")) < 0){
-    printf("there is no column 'use' in csv-file\n");
-    exit(FAILURE);
+  for (b=0; b<plan->n_highres; b++){
+    check_band(plan->highres_band[b], GDALGetRasterCount(dataset[plan->highres_file[b]]));
+    if (!same_grid(dataset[plan->highres_file[b]], &images[HIGHRES].meta)){
+      printf("highres band %d of %s is not on the grid of %s\n", plan->highres_band[b], 
+        args->f_file[plan->highres_file[b]], args->f_file[grid]);
+      exit(FAILURE);
+    }
   }
-  if ((col_band = find_table_col(bandlist, "band")) < 0){
-    printf("there is no column 'use' in csv-file\n");
-    exit(FAILURE);
+
+  // half a highres pixel
+  tol = 0.5 * fabs(images[HIGHRES].meta.transformation[1]);
+
+  for (b=0; b<plan->n_lowres; b++){
+
+    f = plan->lowres_file[b];
+
+    check_band(plan->lowres_band[b], GDALGetRasterCount(dataset[f]));
+
+    if (same_grid(dataset[f], &images[HIGHRES].meta)) continue;
+
+    GDALGetGeoTransform(dataset[f], geotran);
+
+    if (fabs(geotran[0] - images[HIGHRES].meta.transformation[0]) > tol ||
+        fabs(geotran[3] - images[HIGHRES].meta.transformation[3]) > tol ||
+        fabs(GDALGetRasterXSize(dataset[f])*geotran[1] - images[HIGHRES].meta.dim.col*images[HIGHRES].meta.transformation[1]) > tol ||
+        fabs(GDALGetRasterYSize(dataset[f])*geotran[5] - images[HIGHRES].meta.dim.row*images[HIGHRES].meta.transformation[5]) > tol){
+      printf("lowres band %d of %s does not cover the extent of %s\n", plan->lowres_band[b], 
+        args->f_file[f], args->f_file[grid]);
+      exit(FAILURE);
+    }
+
+    if (args->lowres > 1 && 
+       (GDALGetRasterXSize(dataset[f]) != images[LOWRES].meta.dim.col ||
+        GDALGetRasterYSize(dataset[f]) != images[LOWRES].meta.dim.row)){
+      printf("lowres band %d of %s is not on the native grid (factor %d)\n", plan->lowres_band[b], 
+        args->f_file[f], args->lowres);
+      exit(FAILURE);
+    }
+
   }
-  if ((col_wavelength = find_table_col(bandlist, "wavelength")) < 0){
-    printf("there is no column 'wavelength' in csv-file\n");
+
+  check_band(plan->nodata_band, GDALGetRasterCount(dataset[plan->nodata_file]));
+
+  band = GDALGetRasterBand(dataset[plan->nodata_file], plan->nodata_band);
+
+  images[HIGHRES].meta.nodata = (float) GDALGetRasterNoDataValue(band, &has_nodata);
+  images[LOWRES].meta.nodata = images[HIGHRES].meta.nodata;
+  if (!has_nodata){
+    printf("input image %s has no nodata value in band %d.\n", 
+      args->f_file[plan->nodata_file], plan->nodata_band); 
     exit(FAILURE);
   }
 
-  for (b=0; b<bandlist->nrow; b++){
-    if ((int)bandlist->data[b][col_use] == 1) images[HIGHRES].meta.dim.band++;
-    if ((int)bandlist->data[b][col_use] == 2) images[LOWRES].meta.dim.band++;
+  return dataset;
+}
+
+
+/** Close input datasets
+--- dataset: dataset handles
+--- args:    arguments
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void close_dataset(GDALDatasetH *dataset, args_t *args){
+int f;
+
+
+  for (f=0; f<args->n_file; f++) GDALClose(dataset[f]);
+
+  free((void*)dataset);
+
+  return;
+}
+
+
+/** Is the dataset on the grid?
++++ This function checks if a dataset has the dimensions and geotransfor-
++++ mation of a full-scene image.
+--- dataset: dataset handle
+--- meta:    metadata of the full scene
++++ Return: true if on the grid
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+bool same_grid(GDALDatasetH dataset, meta_t *meta){
+double geotran[TRANSFORMLEN];
+int b;
+
+
+  if (GDALGetRasterXSize(dataset) != meta->dim.col) return false;
+  if (GDALGetRasterYSize(dataset) != meta->dim.row) return false;
+
+  GDALGetGeoTransform(dataset, geotran);
+
+  for (b=0; b<TRANSFORMLEN; b++){
+    if (fabs(geotran[b] - meta->transformation[b]) > 1e-6*(fabs(meta->transformation[1]) + fabs(meta->transformation[5]))) return false;
   }
 
+  return true;
+}
+
+
+/** Read a window of rows
++++ This function reads rows r0 to r0+nrow-1 of the HIGHRES bands, and of
++++ the LOWRES bands if requested (at full resolution), into newly allo-
++++ cated images. The metadata of the images is set to the window, i.e. 
++++ the geotransformation is shifted to its first row. The column dimen-
++++ sion and the remaining metadata are taken from open_dataset. The bands
++++ of each input image are read together; LOWRES bands of coarser images
++++ are resampled to the window.
+--- dataset: dataset handles
+--- images:  images
+--- plan:    band plan
+--- args:    arguments
+--- r0:      first row
+--- nrow:    number of rows
+--- lowres:  read LOWRES bands, too?
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void read_rows(GDALDatasetH *dataset, img_t *images, bandplan_t *plan, args_t *args, int r0, int nrow, bool lowres){
+meta_t scene;
+int b, f, nb, nr, col = images[HIGHRES].meta.dim.col;
+int *bands = NULL, *rbands = NULL;
+float **data = NULL, **rdata = NULL;
+
+
+  // full-scene grid
+  memcpy(&scene, &images[HIGHRES].meta, sizeof(meta_t));
+  scene.dim.row = GDALGetRasterYSize(dataset[plan->highres_file[0]]);
+  GDALGetGeoTransform(dataset[plan->highres_file[0]], scene.transformation);
+
+  images[HIGHRES].meta.dim.row = nrow;
+  images[HIGHRES].meta.dim.cell = col*nrow;
+  images[HIGHRES].meta.transformation[0] = scene.transformation[0] + r0*scene.transformation[2];
+  images[HIGHRES].meta.transformation[3] = scene.transformation[3] + r0*scene.transformation[5];
+
   alloc_2D((void***)&images[HIGHRES].data, images[HIGHRES].meta.dim.band, images[HIGHRES].meta.dim.cell, sizeof(float));
-  alloc_2D((void***)&images[LOWRES].data, images[LOWRES].meta.dim.band, images[LOWRES].meta.dim.cell, sizeof(float));
 
-  for (b=0, b_highres=0, b_lowres=0; b<bandlist->nrow; b++){
+  if (lowres){
+
+    images[LOWRES].meta.dim.row  = images[HIGHRES].meta.dim.row;
+    images[LOWRES].meta.dim.cell = images[HIGHRES].meta.dim.cell;
+    images[LOWRES].meta.transformation[0] = images[HIGHRES].meta.transformation[0];
+    images[LOWRES].meta.transformation[3] = images[HIGHRES].meta.transformation[3];
+
+    alloc_2D((void***)&images[LOWRES].data, images[LOWRES].meta.dim.band, images[LOWRES].meta.dim.cell, sizeof(float));
+
+  }
+
+  alloc((void**)&bands,  plan->nb_in, sizeof(int));
+  alloc((void**)&data,   plan->nb_in, sizeof(float*));
+  alloc((void**)&rbands, plan->nb_in, sizeof(int));
+  alloc((void**)&rdata,  plan->nb_in, sizeof(float*));
+
+  for (f=0; f<args->n_file; f++){
+
+    // bands on the grid, and coarser bands that are resampled
+    for (b=0, nb=0, nr=0; b<plan->n_highres; b++){
+      if (plan->highres_file[b] != f) continue;
+      bands[nb] = plan->highres_band[b];
+      data[nb++] = images[HIGHRES].data[b];
+    }
+
+    for (b=0; lowres && b<plan->n_lowres; b++){
+      if (plan->lowres_file[b] != f) continue;
+      if (same_grid(dataset[f], &scene)){
+        bands[nb] = plan->lowres_band[b];
+        data[nb++] = images[LOWRES].data[b];
+      } else {
+        rbands[nr] = plan->lowres_band[b];
+        rdata[nr++] = images[LOWRES].data[b];
+      }
+    }
+
+    // all bands at once for pixel-interleaved images, else band by band
+    if (pixel_interleaved(dataset[f])){
+      read_interleaved(dataset[f], args->f_file[f], args, nb, bands, data, 0, r0, col, nrow);
+    } else {
+      read_window(dataset[f], args->f_file[f], args, nb, bands, data, 0, r0, col, nrow, col, nrow);
+    }
+
+    read_resampled(dataset[f], args->f_file[f], args, nr, rbands, rdata, &scene, r0, nrow);
+
+  }
+
+  free((void*)bands);
+  free((void*)data);
+  free((void*)rbands);
+  free((void*)rdata);
+
+  return;
+}
+
+
+int read_dataset(img_t *images, bandplan_t *plan, args_t *args){
+GDALDatasetH *dataset = NULL;
+int b, f;
+float *buffer = NULL;
+time_t TIME;
+
+  
+  time(&TIME);
+
+  printf("Starting Image Read\n")  ;
+
+
+  dataset = open_dataset(images, plan, args);
+
+  read_rows(dataset, images, plan, args, 0, images[HIGHRES].meta.dim.row, args->lowres == 1);
+
+  // LOWRES bands on their native grid, block-averaged on reading, or
+  // read as they are from coarser images
+  if (args->lowres > 1){
+
+    alloc((void**)&buffer, images[HIGHRES].meta.dim.cell, sizeof(float));
+    alloc_2D((void***)&images[LOWRES].data, images[LOWRES].meta.dim.band, images[LOWRES].meta.dim.cell, sizeof(float));
+
+    for (b=0; b<plan->n_lowres; b++){
+
+      f = plan->lowres_file[b];
+
+      if (same_grid(dataset[f], &images[HIGHRES].meta)){
+
+        read_window(dataset[f], args->f_file[f], args, 1, &plan->lowres_band[b], &buffer, 0, 0, 
+          images[HIGHRES].meta.dim.col, images[HIGHRES].meta.dim.row, 
+          images[HIGHRES].meta.dim.col, images[HIGHRES].meta.dim.row);
+
+        aggregate_band(buffer, images[HIGHRES].meta.dim.row, images[HIGHRES].meta.dim.col, 
+          images[LOWRES].meta.nodata, args->lowres, images[LOWRES].data[b]);
+
+      } else {
+
+        read_window(dataset[f], args->f_file[f], args, 1, &plan->lowres_band[b], &images[LOWRES].data[b], 0, 0, 
+          images[LOWRES].meta.dim.col, images[LOWRES].meta.dim.row, 
+          images[LOWRES].meta.dim.col, images[LOWRES].meta.dim.row);
+
+      }
 
-    if ((int)bandlist->data[b][col_band] > n_band){
-      printf("band %d in bandlist is higher than bands (%d) in dataset\n", (int)bandlist->data[b][col_band], n_band);
-      exit(FAILURE);
     }
 
-    if ((int)bandlist->data[b][col_band] < 1){
-      printf("band %d in bandlist is smaller than 1\n", (int)bandlist->data[b][col_band]);
+    free((void*)buffer);
+
+  }
+
+  close_dataset(dataset, args);
+
+
+  proctime_print("Reading", TIME);
+
+	return SUCCESS;
+}
+
+
+/** Read a window of bands in parallel
++++ This function reads a window of several bands into float buffers. The
++++ bands are read in parallel, and if there are less bands than I/O 
++++ threads, each band is split into stripes of GDAL blocks, which are 
++++ read in parallel, too. Stripes are aligned to the block rows of the 
++++ file, such that each block is decoded by one thread only; the first
++++ and last stripe may be partial. GDAL dataset handles must not be shared
++++ between threads, thus each thread opens its own handle; the calling
++++ thread uses the given one. The number of threads is capped with -i.
+--- dataset: dataset handle
+--- fname:   file name of dataset
+--- args:    arguments
+--- nb:      number of bands
+--- bands:   band numbers
+--- data:    buffers of size bx x by (returned)
+--- xoff:    first column of window
+--- yoff:    first row of window
+--- xsize:   number of columns of window
+--- ysize:   number of rows of window
+--- bx:      number of columns of buffer
+--- by:      number of rows of buffer
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void read_window(GDALDatasetH dataset, char *fname, args_t *args, int nb, int *bands, float **data, int xoff, int yoff, int xsize, int ysize, int bx, int by){
+GDALDatasetH handle = NULL;
+GDALRasterBandH band = NULL;
+int k, b, i0, n, xblock, yblock, nblock;
+int nstripe = 1, stripe = ysize, first = yoff;
+
+
+  if (nb < 1) return;
+
+  // stripes of block rows in the file, if there are less bands than threads
+  if (args->nio > nb && bx == xsize && by == ysize){
+    GDALGetBlockSize(GDALGetRasterBand(dataset, bands[0]), &xblock, &yblock);
+    if (yblock < 1) yblock = 1;
+    first   = yoff / yblock;
+    nblock  = (yoff + ysize - 1) / yblock - first + 1;
+    nstripe = (args->nio + nb - 1) / nb;
+    stripe  = (nblock + nstripe - 1) / nstripe;
+    nstripe = (nblock + stripe - 1) / stripe;
+    stripe *= yblock;
+    first  *= yblock;
+  }
+
+  #pragma omp parallel num_threads(args->nio) private(k,b,i0,n,handle,band) firstprivate(nstripe,stripe,first) shared(dataset,fname,args,nb,bands,data,xoff,yoff,xsize,ysize,bx,by) default(none)
+  {
+
+    if (omp_get_thread_num() == 0){
+      handle = dataset;
+    } else if ((handle = GDALOpen(fname, GA_ReadOnly)) == NULL){
+      printf("unable to open %s\n", fname);
       exit(FAILURE);
     }
 
-    //printf("read band # %d\n", (int)bandlist->data[b][col_band]);
+    #pragma omp for schedule(dynamic)
+    for (k=0; k<nb*nstripe; k++){
 
-    band = GDALGetRasterBand(dataset, (int)bandlist->data[b][col_band]);
+      b  = k / nstripe;
+      i0 = first + (k % nstripe) * stripe - yoff;
+      n  = i0 + stripe;
+      if (i0 < 0) i0 = 0;
+      if (n > ysize) n = ysize;
+      n -= i0;
 
-    if (b == 0){
-      images[HIGHRES].meta.nodata = (float) GDALGetRasterNoDataValue(band, &has_nodata);
-      images[LOWRES].meta.nodata = images[HIGHRES].meta.nodata;
-      if (!has_nodata){
-        printf("input image has no nodata value in band %d.\n", (int)bandlist->data[b][col_band]); 
-        exit(FAILURE);
+      band = GDALGetRasterBand(handle, bands[b]);
+
+      if (nstripe == 1){
+        if (GDALRasterIO(band, GF_Read, xoff, yoff, xsize, ysize, data[b], 
+          bx, by, GDT_Float32, 0, 0) == CE_Failure){
+          printf("could not read band #%d from %s.\n", bands[b], fname); 
+          exit(FAILURE);
+        }
+      } else {
+        if (GDALRasterIO(band, GF_Read, xoff, yoff+i0, xsize, n, data[b] + (size_t)i0*bx, 
+          bx, n, GDT_Float32, 0, 0) == CE_Failure){
+          printf("could not read band #%d from %s.\n", bands[b], fname); 
+          exit(FAILURE);
+        }
       }
+
     }
 
-    if ((int)bandlist->data[b][col_use] == 1){
-      if (GDALRasterIO(band, GF_Read, 0, 0, images[HIGHRES].meta.dim.col, images[HIGHRES].meta.dim.row, images[HIGHRES].data[b_highres++], 
-        images[HIGHRES].meta.dim.col, images[HIGHRES].meta.dim.row, GDT_Float32, 0, 0) == CE_Failure){
-        printf("could not read band #%d from %s.\n", b+1, args->f_input); 
+    if (handle != dataset) GDALClose(handle);
+
+  }
+
+  return;
+}
+
+
+/** Is the dataset pixel-interleaved?
++++ This function checks the interleaving that the driver reports. In a 
++++ pixel-interleaved file, each block holds all bands, thus reading band
++++ by band decodes each block once per band.
+--- dataset: dataset handle
++++ Return: true if pixel-interleaved
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+bool pixel_interleaved(GDALDatasetH dataset){
+const char *interleave = NULL;
+
+
+  interleave = GDALGetMetadataItem(dataset, "INTERLEAVE", "IMAGE_STRUCTURE");
+
+  return (interleave != NULL && strcmp(interleave, "PIXEL") == 0);
+}
+
+
+/** Read a window of a pixel-interleaved dataset
++++ This function reads a window of several bands of a pixel-interleaved
++++ dataset into float buffers. All bands are read in one dataset-level
++++ call per stripe of GDAL blocks, such that each block is decoded once
++++ only. Stripes are aligned to the block rows of the file; the first 
++++ and last stripe may be partial. The band map selects the bands, and 
++++ the stripe is routed to the band buffers. Stripes are read in 
++++ parallel, each thread with its own dataset handle and stripe buffer,
++++ which are only set up when the thread reads a stripe; the calling 
++++ thread uses the given handle.
+--- dataset: dataset handle
+--- fname:   file name of dataset
+--- args:    arguments
+--- nb:      number of bands
+--- bands:   band numbers
+--- data:    buffers of size xsize x ysize (returned)
+--- xoff:    first column of window
+--- yoff:    first row of window
+--- xsize:   number of columns of window
+--- ysize:   number of rows of window
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void read_interleaved(GDALDatasetH dataset, char *fname, args_t *args, int nb, int *bands, float **data, int xoff, int yoff, int xsize, int ysize){
+GDALDatasetH handle = NULL;
+int k, b, i0, n, xblock, yblock, nstripe, nbuf, first;
+float *buffer = NULL;
+
+
+  if (nb < 1 || ysize < 1) return;
+
+  GDALGetBlockSize(GDALGetRasterBand(dataset, bands[0]), &xblock, &yblock);
+  if (yblock < 1) yblock = 1;
+
+  // stripes of block rows in the file, partial at the window edges
+  first   = yoff / yblock;
+  nstripe = (yoff + ysize - 1) / yblock - first + 1;
+  nbuf    = (yblock < ysize) ? yblock : ysize;
+
+  #pragma omp parallel num_threads(args->nio) private(k,b,i0,n,handle,buffer) shared(dataset,fname,args,nb,bands,data,xoff,yoff,xsize,ysize,yblock,nstripe,nbuf,first) default(none)
+  {
+
+    handle = NULL;
+    buffer = NULL;
+
+    #pragma omp for schedule(dynamic)
+    for (k=0; k<nstripe; k++){
+
+      if (handle == NULL){
+        if (omp_get_thread_num() == 0){
+          handle = dataset;
+        } else if ((handle = GDALOpen(fname, GA_ReadOnly)) == NULL){
+          printf("unable to open %s\n", fname);
+          exit(FAILURE);
+        }
+        // one stripe, band-sequential
+        alloc((void**)&buffer, (size_t)nb*xsize*nbuf, sizeof(float));
+      }
+
+      i0 = (first+k)*yblock - yoff;
+      n  = i0 + yblock;
+      if (i0 < 0) i0 = 0;
+      if (n > ysize) n = ysize;
+      n -= i0;
+
+      if (GDALDatasetRasterIO(handle, GF_Read, xoff, yoff+i0, xsize, n, buffer, 
+        xsize, n, GDT_Float32, nb, bands, 0, 0, 0) == CE_Failure){
+        printf("could not read rows %d-%d from %s.\n", yoff+i0, yoff+i0+n-1, fname); 
         exit(FAILURE);
       }
-    } else if ((int)bandlist->data[b][col_use] == 2){
-      if (GDALRasterIO(band, GF_Read, 0, 0, images[LOWRES].meta.dim.col, images[LOWRES].meta.dim.row, images[LOWRES].data[b_lowres++], 
-        images[LOWRES].meta.dim.col, images[LOWRES].meta.dim.row, GDT_Float32, 0, 0) == CE_Failure){
-        printf("could not read band #%d from %s.\n", b+1, args->f_input); 
+
+      for (b=0; b<nb; b++){
+        memcpy(data[b] + (size_t)i0*xsize, buffer + (size_t)b*xsize*n, (size_t)xsize*n*sizeof(float));
+      }
+
+    }
+
+    if (buffer != NULL) free((void*)buffer);
+
+    if (handle != NULL && handle != dataset) GDALClose(handle);
+
+  }
+
+  return;
+}
+
+
+/** Read a window of coarser bands, resampled to the grid
++++ This function reads bands of a coarser image that has the same extent
++++ as the full scene, and resamples them to rows r0 to r0+nrow-1 of the
++++ grid (nearest neighbor). The source window is given in floating-point
++++ coordinates, such that each pixel is resampled as in a full-scene 
++++ read, regardless of the window. Bands are read in parallel, each 
++++ thread with its own dataset handle; the calling thread uses the given
++++ one.
+--- dataset: dataset handle
+--- fname:   file name of dataset
+--- args:    arguments
+--- nb:      number of bands
+--- bands:   band numbers
+--- data:    buffers of size col x nrow (returned)
+--- meta:    metadata of the full scene
+--- r0:      first row
+--- nrow:    number of rows
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void read_resampled(GDALDatasetH dataset, char *fname, args_t *args, int nb, int *bands, float **data, meta_t *meta, int r0, int nrow){
+GDALDatasetH handle = NULL;
+GDALRasterBandH band = NULL;
+GDALRasterIOExtraArg extra;
+int b, col, row, yoff, ysize;
+double scale;
+
+
+  if (nb < 1) return;
+
+  col = GDALGetRasterXSize(dataset);
+  row = GDALGetRasterYSize(dataset);
+
+  // window in source pixels
+  scale = (double)row / meta->dim.row;
+
+  INIT_RASTERIO_EXTRA_ARG(extra);
+  extra.eResampleAlg = GRIORA_NearestNeighbour;
+  extra.bFloatingPointWindowValidity = true;
+  extra.dfXOff  = 0;
+  extra.dfXSize = col;
+  extra.dfYOff  = r0*scale;
+  extra.dfYSize = nrow*scale;
+
+  yoff  = (int)floor(extra.dfYOff);
+  ysize = (int)ceil(extra.dfYOff + extra.dfYSize) - yoff;
+  if (yoff+ysize > row) ysize = row-yoff;
+
+  #pragma omp parallel num_threads(args->nio) private(b,handle,band) firstprivate(extra) shared(dataset,fname,args,nb,bands,data,meta,col,yoff,ysize,nrow) default(none)
+  {
+
+    if (omp_get_thread_num() == 0){
+      handle = dataset;
+    } else if ((handle = GDALOpen(fname, GA_ReadOnly)) == NULL){
+      printf("unable to open %s\n", fname);
+      exit(FAILURE);
+    }
+
+    #pragma omp for schedule(dynamic)
+    for (b=0; b<nb; b++){
+
+      band = GDALGetRasterBand(handle, bands[b]);
+
+      if (GDALRasterIOEx(band, GF_Read, 0, yoff, col, ysize, data[b], 
+        meta->dim.col, nrow, GDT_Float32, 0, 0, &extra) == CE_Failure){
+        printf("could not read band #%d from %s.\n", bands[b], fname); 
         exit(FAILURE);
       }
+
     }
 
+    if (handle != dataset) GDALClose(handle);
+
   }
 
-  GDALClose(dataset);
+  return;
+}
 
 
-  proctime_print("Reading", TIME);
+/** Check band number
++++ This function exits if a band number of the band list is not in the
++++ input image.
+--- band:   band number
+--- n_band: number of bands in input image
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void check_band(int band, int n_band){
 
-	return SUCCESS;
+
+  if (band > n_band){
+    printf("band %d in bandlist is higher than bands (%d) in dataset\n", band, n_band);
+    exit(FAILURE);
+  }
+
+  if (band < 1){
+    printf("band %d in bandlist is smaller than 1\n", band);
+    exit(FAILURE);
+  }
+
+  return;
+}
+
+
+/** Aggregate a band to a coarser grid
++++ This function averages blocks of factor x factor pixels, excluding
++++ nodata. Blocks at the right and bottom edges may be incomplete. Blocks
++++ without any valid pixel are nodata.
+--- fine:   band at full resolution
+--- row:    number of rows at full resolution
+--- col:    number of columns at full resolution
+--- nodata: nodata value
+--- factor: aggregation factor
+--- coarse: aggregated band (returned)
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void aggregate_band(const float *fine, int row, int col, float nodata, int factor, float *coarse){
+int i, j, ci, cj, n;
+int crow = (row + factor - 1) / factor;
+int ccol = (col + factor - 1) / factor;
+double sum;
+
+
+  #pragma omp parallel for private(i,j,cj,n,sum) shared(fine,row,col,nodata,factor,coarse,crow,ccol) default(none)
+  for (ci=0; ci<crow; ci++){
+  for (cj=0; cj<ccol; cj++){
+
+    for (i=ci*factor, n=0, sum=0; i<(ci+1)*factor && i<row; i++){
+    for (j=cj*factor; j<(cj+1)*factor && j<col; j++){
+      if (fequal(fine[i*col+j], nodata)) continue;
+      sum += fine[i*col+j];
+      n++;
+    }
+    }
+
+    coarse[ci*ccol+cj] = (n > 0) ? (float)(sum/n) : nodata;
+
+  }
+  }
+
+  return;
+}
+
+
+/** Read decimated HIGHRES bands
++++ This function reads the HIGHRES bands at a factor x coarser grid into
++++ images[DECIMATED], for estimating the PCA statistics. GDAL reads from
++++ overviews if the input has them, else it subsamples the full-resolu-
++++ tion data (nearest neighbor, nodata is kept as is). This needs to be
++++ called after read_dataset.
+--- images: images
+--- plan:   band plan
+--- args:   arguments
++++ Return: SUCCESS/FAILURE
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int read_decimated(img_t *images, bandplan_t *plan, args_t *args){
+GDALDatasetH dataset = NULL;
+int b, f, nb;
+int *bands = NULL;
+float **data = NULL;
+time_t TIME;
+
+  
+  time(&TIME);
+
+  printf("Starting decimated Image Read\n")  ;
+
+
+  memcpy(&images[DECIMATED].meta, &images[HIGHRES].meta, sizeof(meta_t));
+  images[DECIMATED].meta.dim.col = (images[HIGHRES].meta.dim.col + args->decimate - 1) / args->decimate;
+  images[DECIMATED].meta.dim.row = (images[HIGHRES].meta.dim.row + args->decimate - 1) / args->decimate;
+  images[DECIMATED].meta.dim.cell = images[DECIMATED].meta.dim.col * images[DECIMATED].meta.dim.row;
+  for (b=1; b<TRANSFORMLEN; b++){
+    if (b != 3) images[DECIMATED].meta.transformation[b] *= args->decimate;
+  }
+
+  alloc_2D((void***)&images[DECIMATED].data, images[DECIMATED].meta.dim.band, images[DECIMATED].meta.dim.cell, sizeof(float));
+
+  alloc((void**)&bands, plan->n_highres, sizeof(int));
+  alloc((void**)&data,  plan->n_highres, sizeof(float*));
+
+  for (f=0; f<args->n_file; f++){
+
+    for (b=0, nb=0; b<plan->n_highres; b++){
+      if (plan->highres_file[b] != f) continue;
+      bands[nb] = plan->highres_band[b];
+      data[nb++] = images[DECIMATED].data[b];
+    }
+
+    if (nb == 0) continue;
+
+    if ((dataset = GDALOpen(args->f_file[f], GA_ReadOnly)) == NULL){
+      printf("unable to open %s\n", args->f_file[f]);
+      exit(FAILURE);
+    }
+
+    read_window(dataset, args->f_file[f], args, nb, bands, data, 0, 0, 
+      images[HIGHRES].meta.dim.col, images[HIGHRES].meta.dim.row, 
+      images[DECIMATED].meta.dim.col, images[DECIMATED].meta.dim.row);
+
+    GDALClose(dataset);
+
+  }
+
+  free((void*)bands);
+  free((void*)data);
+
+  printf("%d x %d pixels read for PCA statistics (factor %d)\n", 
+    images[DECIMATED].meta.dim.col, images[DECIMATED].meta.dim.row, args->decimate);
+
+
+  proctime_print("Reading decimated", TIME);
+
+  return SUCCESS;
 }
+
@@ -7,17 +7,24 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <math.h>
+#include <omp.h>
 
 #include "dtype.h"
 #include "alloc.h"
 #include "string.h"
 #include "table.h"
+#include "bandplan.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-int read_dataset(img_t *images, table_t *bandlist, args_t *args);
+GDALDatasetH *open_dataset(img_t *images, bandplan_t *plan, args_t *args);
+void close_dataset(GDALDatasetH *dataset, args_t *args);
+void read_rows(GDALDatasetH *dataset, img_t *images, bandplan_t *plan, args_t *args, int r0, int nrow, bool lowres);
+int read_dataset(img_t *images, bandplan_t *plan, args_t *args);
+int read_decimated(img_t *images, bandplan_t *plan, args_t *args);
 
 #ifdef __cplusplus
 }
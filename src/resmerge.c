@@ -25,178 +25,2071 @@ This file contains functions to enhance spatial resolution
 +++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
 
 
+
+
 #include "resmerge.h"
 
-/** GNU Scientific Library (GSL) **/
-#include <gsl/gsl_multifit.h>          // multi-parameter fitting
+/** GNU Scientific Library (GSL) **/
+#include <gsl/gsl_blas.h>              // basic linear algebra
+#include <gsl/gsl_linalg.h>            // linear algebra
+
+
+// batched kernels are compiled for several instruction sets,
+// the best one is dispatched at runtime
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__)
+#define SIMD_CLONES __attribute__((target_clones("avx512f","avx2","default")))
+#else
+#define SIMD_CLONES
+#endif
+
+// kernels that are instantiated with compile-time sizes
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+// squared-offset stencil, tap t of radius r
+#define STENCIL_OFFSET(t, r) (((t)-(r)) < 0 ? -((t)-(r))*((t)-(r)) : ((t)-(r))*((t)-(r)))
+
+// relative tolerance of fast solvers against the SVD reference
+#define CHECK_TOLERANCE 1e-3
+#define CHECK_SAMPLES 10000
+
+// sampled pixels and largest step of the grid quality summary
+#define GRID_CHECK_SAMPLES 1000
+#define GRID_CHECK_STEP 4
+
+// L2 cache size if it cannot be queried, minimum tile size
+#define L2_DEFAULT 262144
+#define TILE_MIN 16
+
+
+typedef struct {
+  int nw, nv, nb;
+  gsl_matrix *X, *U, *V;
+  gsl_vector *x, **y, *h, *S, *D, *z;
+} svd_work_t;
+
+typedef struct {
+  int i0, j0;       // image position of 1st core pixel
+  int nrow, ncol;   // core size
+  int halo;         // halo width
+  int srow, scol;   // size of scratch buffer, incl. halo
+  int size;         // max. core size
+  int ns;           // values per pixel: validity, components, LOWRES bands
+  float *data;      // pixel-interleaved scratch buffer
+  int nw;           // number of kernel pixels
+  int *offset;      // kernel offsets in scratch buffer, relative to center
+  int *count;       // integral image of validity, incl. halo
+} tile_t;
+
+
+void alloc_svd_work(svd_work_t *work, int nw, int nv, int nb);
+void free_svd_work(svd_work_t *work);
+int predict_svd(img_t *images, char *valid, args_t *args, int i, int j, svd_work_t *work, double *pred);
+int gather_svd_tile(tile_t *tile, int i, int j, svd_work_t *work);
+bool window_mean(svd_work_t *work, int k, double threshold, double *pred);
+int gather_svd(img_t *images, char *valid, args_t *args, int i, int j, svd_work_t *work);
+int fit_svd(svd_work_t *work, int k, double *pred);
+void pad_svd(svd_work_t *work, int k);
+int coef_svd(img_t *images, char *valid, args_t *args, int i, int j, svd_work_t *work, double *coef);
+int tile_size(args_t *args, int ns, int halo);
+void load_tile(img_t *images, char *valid, tile_t *tile, int i0, int j0, int radius);
+bool window_valid(tile_t *tile, int i, int j);
+int smoother_weights(const gsl_matrix *X, const gsl_vector *x, gsl_matrix *U, gsl_matrix *V, gsl_vector *S, gsl_vector *D, gsl_vector *z, gsl_vector *h);
+int regression_coefficients(const gsl_matrix *X, gsl_vector **y, int ny, gsl_matrix *U, gsl_matrix *V, gsl_vector *S, gsl_vector *D, gsl_vector *z, double *coef);
+int resmerge_svd(img_t *images, char *valid, mask_t *mask, args_t *args, spectral_t *fused);
+int resmerge_gram(img_t *images, char *valid, mask_t *mask, args_t *args, spectral_t *fused);
+void gram_sums_row(double *V, img_t *images, char *valid, int row, int q_x, int q_xx, int q_y, int q_xy);
+void stencil_sums(double *H, const double *V, int nq, int ncol, int radius);
+void stencil_sums_1(double *H, const double *V, int nq, int ncol, int radius);
+void stencil_sums_2(double *H, const double *V, int nq, int ncol, int radius);
+void stencil_sums_3(double *H, const double *V, int nq, int ncol, int radius);
+void stencil_sums_4(double *H, const double *V, int nq, int ncol, int radius);
+void gram_solve_batch(double *A, double *rhs, double *tol, char *fail, int n, int nrhs, int nlane);
+void gram_solve_batch_1(double *A, double *rhs, double *tol, char *fail, int n, int nrhs, int nlane);
+void gram_solve_batch_2(double *A, double *rhs, double *tol, char *fail, int n, int nrhs, int nlane);
+void gram_solve_batch_3(double *A, double *rhs, double *tol, char *fail, int n, int nrhs, int nlane);
+void gram_solve_batch_4(double *A, double *rhs, double *tol, char *fail, int n, int nrhs, int nlane);
+void gram_solve_batch_5(double *A, double *rhs, double *tol, char *fail, int n, int nrhs, int nlane);
+void gram_solve_batch_6(double *A, double *rhs, double *tol, char *fail, int n, int nrhs, int nlane);
+void gram_solve_batch_7(double *A, double *rhs, double *tol, char *fail, int n, int nrhs, int nlane);
+int gram_solve(double *A, double *rhs, int n, int nrhs);
+int resmerge_check(img_t *images, char *valid, mask_t *mask, args_t *args);
+int grid_nodes(int n, int step);
+int grid_position(int g, int n, int step);
+void grid_cell(int x, int n, int step, int *g0, int *g1, double *w);
+int interpolate_coef(const float *coef, const char *ok, const int *node, double wi, double wj, int n, double *out);
+int kernel_count(img_t *images, char *valid, args_t *args, int i, int j);
+void apply_coef(img_t *images, int p, const double *coef, int nv, int nb, double *pred);
+int resmerge_grid(img_t *images, char *valid, mask_t *mask, args_t *args, spectral_t *fused);
+int resmerge_check_grid(img_t *images, char *valid, mask_t *mask, args_t *args);
+void native_cell(int x, int n, int factor, int *g0, int *g1, double *w);
+int resmerge_native(img_t *images, mask_t *mask, args_t *args, spectral_t *fused);
+
+
+/** Allocate SVD workspace
+--- work:   workspace
+--- nw:     number of kernel pixels
+--- nv:     number of predictors (incl. intercept)
+--- nb:     number of LOWRES bands
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void alloc_svd_work(svd_work_t *work, int nw, int nv, int nb){
+int b, k;
+
+
+  work->nw = nw;
+  work->nv = nv;
+  work->nb = nb;
+
+  // nw-by-nv predictor variables; kernel + central pixel
+  work->X = gsl_matrix_calloc(nw, nv);
+  work->x = gsl_vector_calloc(nv);
+
+  // set first column of X to 1 -> intercept c0
+  for (k=0; k<nw; k++) gsl_matrix_set(work->X, k, 0, 1.0);
+  gsl_vector_set(work->x, 0, 1.0);
+
+  // vector of nw observations
+  alloc((void**)&work->y, nb, sizeof(gsl_vector*));
+  for (b=0; b<nb; b++) work->y[b] = gsl_vector_calloc(nw);
+
+  // nw prediction weights
+  work->h = gsl_vector_calloc(nw);
+
+  // SVD workspace, shared by all bands as X is the same for each of them
+  work->U = gsl_matrix_calloc(nw, nv);
+  work->V = gsl_matrix_calloc(nv, nv);
+  work->S = gsl_vector_calloc(nv);
+  work->D = gsl_vector_calloc(nv);
+  work->z = gsl_vector_calloc(nv);
+
+  return;
+}
+
+
+/** Coefficients of a least-squares fit
++++ This function solves X c = y for several right-hand sides y, which 
++++ share the design matrix. With the column-balanced SVD 
++++ X D^-1 = U S V^T, c = D^-1 V S^-1 U^T y. Singular values below machine
++++ precision are truncated, like in smoother_weights.
+--- X:      n x p design matrix
+--- y:      ny vectors of n observations
+--- ny:     number of observation vectors
+--- U:      n x p workspace
+--- V:      p x p workspace
+--- S:      p workspace
+--- D:      p workspace
+--- z:      p workspace
+--- coef:   p coefficients for each observation vector (returned)
++++ Return: SUCCESS/FAILURE
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int regression_coefficients(const gsl_matrix *X, gsl_vector **y, int ny, gsl_matrix *U, gsl_matrix *V, gsl_vector *S, gsl_vector *D, gsl_vector *z, double *coef){
+size_t j, k, p = X->size2;
+double s0, sk, cj;
+int b;
+
+
+  gsl_matrix_memcpy(U, X);
+  gsl_linalg_balance_columns(U, D);
+  gsl_linalg_SV_decomp(U, V, S, z);
+
+  s0 = gsl_vector_get(S, 0);
+
+  for (b=0; b<ny; b++){
+
+    // z = S^-1 U^T y
+    gsl_blas_dgemv(CblasTrans, 1.0, U, y[b], 0.0, z);
+
+    for (k=0; k<p; k++){
+      sk = gsl_vector_get(S, k);
+      if (sk <= GSL_DBL_EPSILON * s0){
+        gsl_vector_set(z, k, 0.0);
+      } else {
+        gsl_vector_set(z, k, gsl_vector_get(z, k)/sk);
+      }
+    }
+
+    // c = D^-1 V z
+    for (j=0; j<p; j++){
+      for (k=0, cj=0; k<p; k++) cj += gsl_matrix_get(V, j, k) * gsl_vector_get(z, k);
+      coef[b*p+j] = cj / gsl_vector_get(D, j);
+    }
+
+  }
+
+  return SUCCESS;
+}
+
+
+/** Free SVD workspace
+--- work:   workspace
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void free_svd_work(svd_work_t *work){
+int b;
+
+
+  gsl_matrix_free(work->X); gsl_vector_free(work->x);
+  for (b=0; b<work->nb; b++) gsl_vector_free(work->y[b]); 
+  free((void*)work->y);
+  gsl_vector_free(work->h);
+  gsl_matrix_free(work->U); gsl_matrix_free(work->V);
+  gsl_vector_free(work->S); gsl_vector_free(work->D); gsl_vector_free(work->z);
+
+  return;
+}
+
+
+/** Predict one pixel with the SVD engine
++++ This function fits a local regression of the LOWRES bands against the
++++ principal components within the kernel of a pixel, and predicts the
++++ central pixel. Only the prediction is needed, thus no coefficients 
++++ are solved for: the design matrix is factorized once (SVD), and the 
++++ prediction weights of the kernel pixels are derived from it. The 
++++ prediction for each LOWRES band is the dot product of these weights
++++ with the band's observations.
+--- images: images
+--- valid:  neighbor validity
+--- args:   arguments
+--- i:      row
+--- j:      column
+--- work:   workspace
+--- pred:   prediction for each LOWRES band (returned)
++++ Return: SUCCESS/FAILURE (FAILURE: not enough valid neighbors)
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int predict_svd(img_t *images, char *valid, args_t *args, int i, int j, svd_work_t *work, double *pred){
+int k;
+
+
+  k = gather_svd(images, valid, args, i, j, work);
+
+  return fit_svd(work, k, pred);
+}
+
+
+/** Gather the kernel of one pixel for the SVD engine
++++ This function copies the predictors of the central pixel, and the 
++++ predictors and observations of all valid kernel pixels into the 
++++ workspace.
+--- images: images
+--- valid:  neighbor validity
+--- args:   arguments
+--- i:      row
+--- j:      column
+--- work:   workspace
++++ Return: number of gathered kernel pixels
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int gather_svd(img_t *images, char *valid, args_t *args, int i, int j, svd_work_t *work){
+int b, p, ii, jj, ni, nj, np, k = 0;
+
+
+  p = i*images[PCA].meta.dim.col+j;
+
+  // add central pixel
+  for (b=0; b<images[PCA].meta.dim.band; b++) gsl_vector_set(work->x, b+1, images[PCA].data[b][p]);
+
+  // add neighboring pixels
+  for (ii=-args->radius; ii<=args->radius; ii++){
+  for (jj=-args->radius; jj<=args->radius; jj++){
+
+    if (ii < 0) ni = i-ii*ii; else ni = i+ii*ii;
+    if (jj < 0) nj = j-jj*jj; else nj = j+jj*jj;
+
+    if (ni < 0 || ni >= images[PCA].meta.dim.row || nj < 0 || nj >= images[PCA].meta.dim.col) continue;
+    np = ni*images[PCA].meta.dim.col+nj;
+
+    if (!valid[np]) continue;
+
+    for (b=0; b<images[LOWRES].meta.dim.band; b++) gsl_vector_set(work->y[b], k, images[LOWRES].data[b][np]);
+    for (b=0; b<images[PCA].meta.dim.band; b++) gsl_matrix_set(work->X, k, b+1, images[PCA].data[b][np]);
+    k++;
+
+  }
+  }
+
+  return k;
+}
+
+
+/** Gather the kernel of one pixel of a tile for the SVD engine
++++ This function is the same as gather_svd, but reads the kernel from the
++++ pixel-interleaved scratch buffer of a tile. Pixels outside of the image
++++ are flagged invalid in the halo, thus no bounds checks are needed. The
++++ kernel is read through the tile's offset table. If the window is fully
++++ valid, the kernel is copied without validity checks.
+--- tile:   tile
+--- i:      row in tile core
+--- j:      column in tile core
+--- work:   workspace
++++ Return: number of gathered kernel pixels
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int gather_svd_tile(tile_t *tile, int i, int j, svd_work_t *work){
+int b, t, k = 0;
+int nc = work->nv-1, nb = work->nb;
+const float *center, *neighbor;
+
+
+  center = tile->data + ((i+tile->halo)*tile->scol + j+tile->halo)*tile->ns;
+
+  // add central pixel
+  for (b=0; b<nc; b++) gsl_vector_set(work->x, b+1, center[1+b]);
+
+  // add neighboring pixels
+  if (window_valid(tile, i, j)){
+
+    for (k=0; k<tile->nw; k++){
+      neighbor = center + tile->offset[k];
+      for (b=0; b<nb; b++) gsl_vector_set(work->y[b], k, neighbor[1+nc+b]);
+      for (b=0; b<nc; b++) gsl_matrix_set(work->X, k, b+1, neighbor[1+b]);
+    }
+
+  } else {
+
+    for (t=0; t<tile->nw; t++){
+
+      neighbor = center + tile->offset[t];
+
+      if (neighbor[0] == 0) continue;
+
+      for (b=0; b<nb; b++) gsl_vector_set(work->y[b], k, neighbor[1+nc+b]);
+      for (b=0; b<nc; b++) gsl_matrix_set(work->X, k, b+1, neighbor[1+b]);
+      k++;
+
+    }
+
+  }
+
+  return k;
+}
+
+
+/** Mean of a homogeneous window
++++ This function tests whether a gathered kernel is homogeneous, i.e. the
++++ standard deviation of each LOWRES band is below a threshold. If so, 
++++ the window mean is returned as prediction, as a regression would not
++++ add spatial detail. The sums are shifted by the first sample to avoid
++++ cancellation, as the threshold can be small against the values.
+--- work:      workspace, holding k gathered kernel pixels
+--- k:         number of gathered kernel pixels
+--- threshold: max. standard deviation
+--- pred:      window mean for each LOWRES band (returned)
++++ Return:    true/false (homogeneous or not)
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+bool window_mean(svd_work_t *work, int k, double threshold, double *pred){
+int b, n;
+double y0, d, sum, sum_sq, var;
+
+
+  for (b=0; b<work->nb; b++){
+
+    y0 = gsl_vector_get(work->y[b], 0);
+
+    for (n=1, sum=0, sum_sq=0; n<k; n++){
+      d = gsl_vector_get(work->y[b], n) - y0;
+      sum += d;
+      sum_sq += d*d;
+    }
+
+    pred[b] = y0 + sum/k;
+    var = (sum_sq - sum*sum/k)/k;
+
+    if (var > threshold*threshold) return false;
+
+  }
+
+  return true;
+}
+
+
+/** Fit the SVD engine to a gathered kernel
++++ This function fills the design matrix up to nw rows, factorizes it and
++++ predicts the central pixel.
+--- work:   workspace, holding k gathered kernel pixels
+--- k:      number of gathered kernel pixels
+--- pred:   prediction for each LOWRES band (returned)
++++ Return: SUCCESS/FAILURE (FAILURE: not enough valid neighbors)
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int fit_svd(svd_work_t *work, int k, double *pred){
+int b;
+
+
+  if (k < work->nw/2) return FAILURE;
+
+  pad_svd(work, k);
+
+  // factorize X once, and derive prediction weights
+  smoother_weights(work->X, work->x, work->U, work->V, work->S, work->D, work->z, work->h);
+
+  // predict central pixel for each band
+  for (b=0; b<work->nb; b++) gsl_blas_ddot(work->h, work->y[b], &pred[b]);
+
+  return SUCCESS;
+}
+
+
+/** Fill the SVD engine's design matrix
++++ This function appends zero rows, if less than nw kernel pixels were
++++ gathered.
+--- work:   workspace, holding k gathered kernel pixels
+--- k:      number of gathered kernel pixels
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void pad_svd(svd_work_t *work, int k){
+int b;
+
+
+  while (k < work->nw){
+    for (b=1; b<work->nv; b++) gsl_matrix_set(work->X, k, b, 0.0);
+    for (b=0; b<work->nb; b++) gsl_vector_set(work->y[b], k, 0.0);
+    k++;
+  }
+
+  return;
+}
+
+
+/** Regression coefficients of one pixel with the SVD engine
++++ This function fits the local regression within the kernel of a pixel,
++++ like predict_svd, but solves for the coefficients. These can be 
++++ applied to other pixels than the central one.
+--- images: images
+--- valid:  neighbor validity
+--- args:   arguments
+--- i:      row
+--- j:      column
+--- work:   workspace
+--- coef:   nv coefficients for each LOWRES band (returned)
++++ Return: SUCCESS/FAILURE (FAILURE: not enough valid neighbors)
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int coef_svd(img_t *images, char *valid, args_t *args, int i, int j, svd_work_t *work, double *coef){
+int k;
+
+
+  k = gather_svd(images, valid, args, i, j, work);
+
+  if (k < work->nw/2) return FAILURE;
+
+  pad_svd(work, k);
+
+  return regression_coefficients(work->X, work->y, work->nb, work->U, work->V, work->S, work->D, work->z, coef);
+}
+
+
+/** Tile size
++++ This function returns the edge length of square tiles. If not given by
++++ the user, the size is chosen such that the scratch buffer of a tile, 
++++ incl. halo, fills half of the L2 cache.
+--- args:   arguments
+--- ns:     values per pixel
+--- halo:   halo width
++++ Return: tile size
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int tile_size(args_t *args, int ns, int halo){
+long l2 = 0;
+int size;
+
+
+  if (args->tile > 0) return args->tile;
+
+  #ifdef _SC_LEVEL2_CACHE_SIZE
+  l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+  #endif
+  if (l2 <= 0) l2 = L2_DEFAULT;
+
+  size = (int)sqrt(l2 / 2.0 / (ns*sizeof(float))) - 2*halo;
+  if (size < TILE_MIN) size = TILE_MIN;
+
+  return size;
+}
+
+
+/** Load tile
++++ This function copies the core and halo of a tile into its pixel-
++++ interleaved scratch buffer. Each pixel holds its validity, the 
++++ components and the LOWRES bands. Pixels outside of the image are
++++ flagged invalid. The kernel offsets are compiled for the buffer's 
++++ width, and the validity is summed into an integral image.
+--- images: images
+--- valid:  neighbor validity
+--- tile:   tile
+--- i0:     image row of 1st core pixel
+--- j0:     image column of 1st core pixel
+--- radius: kernel radius
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void load_tile(img_t *images, char *valid, tile_t *tile, int i0, int j0, int radius){
+int b, i, j, si, sj, p, ii, jj, k;
+int nc = images[PCA].meta.dim.band;
+int nb = images[LOWRES].meta.dim.band;
+float *s;
+int *above, *count;
+
+
+  tile->i0 = i0;
+  tile->j0 = j0;
+  tile->nrow = (i0+tile->size > images[PCA].meta.dim.row) ? images[PCA].meta.dim.row-i0 : tile->size;
+  tile->ncol = (j0+tile->size > images[PCA].meta.dim.col) ? images[PCA].meta.dim.col-j0 : tile->size;
+  tile->srow = tile->nrow + 2*tile->halo;
+  tile->scol = tile->ncol + 2*tile->halo;
+
+  for (si=0, s=tile->data; si<tile->srow; si++){
+
+    i = i0 - tile->halo + si;
+
+    for (sj=0; sj<tile->scol; sj++, s+=tile->ns){
+
+      j = j0 - tile->halo + sj;
+
+      if (i < 0 || i >= images[PCA].meta.dim.row || j < 0 || j >= images[PCA].meta.dim.col){
+        s[0] = 0;
+        continue;
+      }
+
+      p = i*images[PCA].meta.dim.col+j;
+
+      s[0] = valid[p];
+      for (b=0; b<nc; b++) s[1+b]    = images[PCA].data[b][p];
+      for (b=0; b<nb; b++) s[1+nc+b] = images[LOWRES].data[b][p];
+
+    }
+  }
+
+  // kernel offsets, same order as in predict_svd
+  for (ii=0, k=0; ii<=2*radius; ii++){
+  for (jj=0; jj<=2*radius; jj++, k++){
+    tile->offset[k] = (STENCIL_OFFSET(ii, radius)*tile->scol + STENCIL_OFFSET(jj, radius))*tile->ns;
+  }
+  }
+
+  // integral image of validity, (srow+1) x (scol+1)
+  for (sj=0; sj<=tile->scol; sj++) tile->count[sj] = 0;
+
+  for (si=0, s=tile->data; si<tile->srow; si++){
+
+    above = tile->count + si*(tile->scol+1);
+    count = above + tile->scol+1;
+    count[0] = 0;
+
+    for (sj=0, k=0; sj<tile->scol; sj++, s+=tile->ns){
+      k += (s[0] != 0);
+      count[sj+1] = above[sj+1] + k;
+    }
+
+  }
+
+  return;
+}
+
+
+/** Fully valid window
++++ This function tests whether all pixels within the bounding box of a
++++ pixel's kernel are valid, using the tile's integral image.
+--- tile:   tile
+--- i:      row in tile core
+--- j:      column in tile core
++++ Return: true/false
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+bool window_valid(tile_t *tile, int i, int j){
+int w = 2*tile->halo+1, n;
+const int *top, *bottom;
+
+
+  // core pixel (i,j) is at (i+halo, j+halo) in the buffer, thus its 
+  // window spans rows i..i+2*halo and columns j..j+2*halo
+  top    = tile->count + i*(tile->scol+1);
+  bottom = top + w*(tile->scol+1);
+
+  n = bottom[j+w] - bottom[j] - top[j+w] + top[j];
+
+  return n == w*w;
+}
+
+
+/** Prediction weights of a least-squares fit
++++ This function computes the weights h, such that the prediction x^T c of
++++ the least-squares solution c of X c = y is h^T y, for any y. With the
++++ column-balanced SVD X D^-1 = U S V^T, h = U S^-1 V^T D^-1 x. Singular 
++++ values below machine precision are truncated (minimum-norm solution),
++++ like gsl_multifit_linear does.
+--- X:      n x p design matrix
+--- x:      p predictors of the pixel to predict
+--- U:      n x p workspace
+--- V:      p x p workspace
+--- S:      p workspace
+--- D:      p workspace
+--- z:      p workspace
+--- h:      n prediction weights (returned)
++++ Return: SUCCESS/FAILURE
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int smoother_weights(const gsl_matrix *X, const gsl_vector *x, gsl_matrix *U, gsl_matrix *V, gsl_vector *S, gsl_vector *D, gsl_vector *z, gsl_vector *h){
+size_t j, k;
+double s0, sk, zk;
+
+
+  gsl_matrix_memcpy(U, X);
+  gsl_linalg_balance_columns(U, D);
+  gsl_linalg_SV_decomp(U, V, S, z);
+
+  s0 = gsl_vector_get(S, 0);
+
+  // z = S^-1 V^T D^-1 x
+  for (k=0; k<X->size2; k++){
+
+    sk = gsl_vector_get(S, k);
+
+    if (sk <= GSL_DBL_EPSILON * s0){
+      gsl_vector_set(z, k, 0.0);
+      continue;
+    }
+
+    for (j=0, zk=0; j<X->size2; j++){
+      zk += gsl_matrix_get(V, j, k) * gsl_vector_get(x, j) / gsl_vector_get(D, j);
+    }
+
+    gsl_vector_set(z, k, zk/sk);
+
+  }
+
+  // h = U z
+  gsl_blas_dgemv(CblasNoTrans, 1.0, U, z, 0.0, h);
+
+  return SUCCESS;
+}
+
+
+/** Resolution merge, SVD engine
++++ This function predicts every pixel with the SVD engine. The image is 
++++ traversed in square tiles: each thread copies a tile plus its halo 
++++ into a compact, pixel-interleaved scratch buffer, which fits into the
++++ L2 cache, and gathers all kernels of the tile from there.
+--- images: images
+--- valid:  neighbor validity
+--- mask:   validity mask
+--- args:   arguments
+--- fused:  spectral fit per tile, or NULL
++++ Return: SUCCESS/FAILURE
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int resmerge_svd(img_t *images, char *valid, mask_t *mask, args_t *args, spectral_t *fused){
+int b, i, j, p, t, k, n_fit = 0, n_mean = 0;
+int i0, j0, nrow, ncol;
+int nw, nv = images[PCA].meta.dim.band + 1;
+int nb = images[LOWRES].meta.dim.band;
+int size, halo, ns, n_tile_row, n_tile_col;
+svd_work_t work;
+spectral_work_t sw;
+tile_t tile;
+double *pred = NULL;
+
+
+  // kernel size
+  nw = (2 * args->radius + 1) * (2 * args->radius + 1);
+
+  // tiling
+  halo = args->radius * args->radius;
+  ns   = 1 + images[PCA].meta.dim.band + nb;
+  size = tile_size(args, ns, halo);
+  n_tile_row = (images[PCA].meta.dim.row + size - 1) / size;
+  n_tile_col = (images[PCA].meta.dim.col + size - 1) / size;
+
+  printf("%d x %d tiles of %d x %d pixels\n", n_tile_row, n_tile_col, size, size);
+
+
+  #pragma omp parallel private(b,i,j,p,k,i0,j0,nrow,ncol,work,sw,tile,pred) shared(nw,nv,nb,size,halo,ns,n_tile_row,n_tile_col,valid,mask,images,args,fused) reduction(+: n_fit, n_mean) default(none)
+  {
+
+    alloc_svd_work(&work, nw, nv, nb);
+    if (fused != NULL) alloc_spectral_work(fused, &sw);
+    alloc((void**)&pred, nb, sizeof(double));
+
+    tile.size = size;
+    tile.halo = halo;
+    tile.ns   = ns;
+    tile.nw   = nw;
+    alloc((void**)&tile.data, (size+2*halo)*(size+2*halo)*ns, sizeof(float));
+    alloc((void**)&tile.offset, nw, sizeof(int));
+    alloc((void**)&tile.count, (size+2*halo+1)*(size+2*halo+1), sizeof(int));
+
+    /** do regression for every valid pixel, and for each 20m band
+    +++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+
+    #pragma omp for schedule(dynamic)
+    for (t=0; t<n_tile_row*n_tile_col; t++){
+
+      i0 = (t / n_tile_col) * size;
+      j0 = (t % n_tile_col) * size;
+      nrow = (i0+size > images[PCA].meta.dim.row) ? images[PCA].meta.dim.row-i0 : size;
+      ncol = (j0+size > images[PCA].meta.dim.col) ? images[PCA].meta.dim.col-j0 : size;
+
+      // no valid pixel in this tile
+      for (i=0; i<nrow && !mask_any(mask, (i0+i)*images[PCA].meta.dim.col+j0, ncol); i++);
+
+      if (i == nrow){
+        for (i=0; i<nrow; i++){
+          p = (i0+i)*images[PCA].meta.dim.col + j0;
+          for (b=0; b<nb; b++){
+            for (j=0; j<ncol; j++) images[SHARPENED].data[b][p+j] = images[LOWRES].meta.nodata;
+          }
+          if (fused != NULL) apply_spectral(fused, &sw, p, ncol);
+        }
+        continue;
+      }
+
+      load_tile(images, valid, &tile, i0, j0, args->radius);
+
+      for (i=0; i<tile.nrow; i++){
+      for (j=0; j<tile.ncol; j++){
+
+        p = (tile.i0+i)*images[PCA].meta.dim.col + tile.j0+j;
+
+        if (!MASK_VALID(mask, p)){
+          for (b=0; b<nb; b++) images[SHARPENED].data[b][p] = images[LOWRES].meta.nodata;
+          continue;
+        }
+
+        k = gather_svd_tile(&tile, i, j, &work);
+
+        // homogeneous window: mean, else full regression
+        if (args->homogeneity > 0 && k >= nw/2 && 
+            window_mean(&work, k, args->homogeneity, pred)){
+          n_mean++;
+        } else if (fit_svd(&work, k, pred) == SUCCESS){
+          n_fit++;
+        } else {
+          for (b=0; b<nb; b++) images[SHARPENED].data[b][p] = images[LOWRES].meta.nodata;
+          mask_clear(mask, p);
+          continue;
+        }
+
+        for (b=0; b<nb; b++) images[SHARPENED].data[b][p] = pred[b];
+
+      }
+      }
+
+      // spectral fit of the tile, while it is still in cache
+      if (fused != NULL){
+        for (i=0; i<tile.nrow; i++){
+          apply_spectral(fused, &sw, (tile.i0+i)*images[PCA].meta.dim.col + tile.j0, tile.ncol);
+        }
+      }
+
+    }
+
+    free_svd_work(&work);
+    if (fused != NULL) free_spectral_work(fused, &sw);
+    free((void*)pred);
+    free((void*)tile.data);
+    free((void*)tile.offset);
+    free((void*)tile.count);
+
+  }
+
+  if (args->homogeneity > 0){
+    printf("%d pixels fitted, %d homogeneous pixels (window mean)\n", n_fit, n_mean);
+  }
+
+
+  return SUCCESS;
+}
+
+
+/** Resolution merge, Gram engine
++++ This function fits the same local regression as resmerge_svd, but 
++++ solves the normal equations instead. The kernel sums of all cross-
++++ products (PCA x PCA, PCA x LOWRES) are computed with separable sums:
++++ the squared-offset kernel is the product of a row and a column stencil
++++ of 2r+1 taps each, thus the sums are first accumulated vertically for
++++ a full image row, and then horizontally. This costs O(r) instead of
++++ O(r^2 nv^2) per pixel. The fill rows of resmerge_svd (intercept only,
++++ zero observation) are honored by using nw as sample size. The 
++++ regression is solved in centered form, i.e. a nc x nc system with nc
++++ = number of components. All sums and systems of one row are held in
++++ structure-of-arrays layout (one pixel per SIMD lane), and are solved
++++ in one batch.
+--- images: images
+--- valid:  neighbor validity
+--- mask:   validity mask
+--- args:   arguments
+--- fused:  spectral fit per tile, or NULL
++++ Return: SUCCESS/FAILURE
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int resmerge_gram(img_t *images, char *valid, mask_t *mask, args_t *args, spectral_t *fused){
+int b, c, d, q, t, i, j, p, ni;
+int w, nw, *offset = NULL, *qxx = NULL;
+int nc = images[PCA].meta.dim.band;
+int nb = images[LOWRES].meta.dim.band;
+int nrow = images[PCA].meta.dim.row;
+int ncol = images[PCA].meta.dim.col;
+int nq, q_x, q_xx, q_y, q_xy;
+double *V = NULL, *H = NULL, *A = NULL, *rhs = NULL, *tol = NULL;
+double *A1 = NULL, *rhs1 = NULL;
+char *fail = NULL;
+double pred;
+spectral_work_t sw;
+void (*stencil)(double*, const double*, int, int, int);
+void (*solve)(double*, double*, double*, char*, int, int, int);
+
+
+  // kernel size
+  w = 2 * args->radius + 1;
+  nw = w * w;
+
+  // stencil offsets (squared distance, same as resmerge_svd)
+  alloc((void**)&offset, w, sizeof(int));
+  for (t=0; t<w; t++) offset[t] = STENCIL_OFFSET(t, args->radius);
+
+  // kernels with compile-time sizes for common radii and number of
+  // components, generic kernels otherwise
+  switch (args->radius){
+    case 1:  stencil = stencil_sums_1; break;
+    case 2:  stencil = stencil_sums_2; break;
+    case 3:  stencil = stencil_sums_3; break;
+    case 4:  stencil = stencil_sums_4; break;
+    default: stencil = stencil_sums;
+  }
+
+  switch (nc){
+    case 1:  solve = gram_solve_batch_1; break;
+    case 2:  solve = gram_solve_batch_2; break;
+    case 3:  solve = gram_solve_batch_3; break;
+    case 4:  solve = gram_solve_batch_4; break;
+    case 5:  solve = gram_solve_batch_5; break;
+    case 6:  solve = gram_solve_batch_6; break;
+    case 7:  solve = gram_solve_batch_7; break;
+    default: solve = gram_solve_batch;
+  }
+
+  // layout of summed quantities: 
+  // count, PCA, PCA x PCA (upper triangle), LOWRES, PCA x LOWRES
+  q_x  = 1;
+  q_xx = q_x  + nc;
+  q_y  = q_xx + nc*(nc+1)/2;
+  q_xy = q_y  + nb;
+  nq   = q_xy + nc*nb;
+
+  // position of PCA x PCA for any pair of components
+  alloc((void**)&qxx, nc*nc, sizeof(int));
+  for (c=0, q=q_xx; c<nc; c++){
+  for (d=c; d<nc; d++, q++){
+    qxx[c*nc+d] = qxx[d*nc+c] = q;
+  }
+  }
+
+
+  #pragma omp parallel private(b,c,d,q,t,j,p,ni,V,H,A,rhs,tol,A1,rhs1,fail,pred,sw) shared(w,nw,nc,nb,nrow,ncol,nq,q_x,q_xx,q_y,q_xy,offset,qxx,stencil,solve,valid,mask,images,args,fused) default(none)
+  {
+
+    /** initialize and allocate
+    +++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+
+    // vertical and kernel sums of one row
+    alloc((void**)&V, nq*ncol, sizeof(double));
+    alloc((void**)&H, nq*ncol, sizeof(double));
+
+    // centered normal equations of one row
+    alloc((void**)&A,   nc*nc*ncol, sizeof(double));
+    alloc((void**)&rhs, nb*nc*ncol, sizeof(double));
+    alloc((void**)&tol,  ncol, sizeof(double));
+    alloc((void**)&fail, ncol, sizeof(char));
+
+    // normal equations of one pixel
+    alloc((void**)&A1,   nc*nc, sizeof(double));
+    alloc((void**)&rhs1, nb*nc, sizeof(double));
+
+    if (fused != NULL) alloc_spectral_work(fused, &sw);
+
+
+    #pragma omp for schedule(guided)  
+    for (i=0; i<nrow; i++){
+
+
+      // no valid pixel in this row
+      if (!mask_any(mask, i*ncol, ncol)){
+        for (b=0; b<nb; b++){
+          for (j=0; j<ncol; j++) images[SHARPENED].data[b][i*ncol+j] = images[LOWRES].meta.nodata;
+        }
+        if (fused != NULL) apply_spectral(fused, &sw, i*ncol, ncol);
+        continue;
+      }
+
+
+      /** vertical sums over the row stencil
+      +++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+
+      memset(V, 0, nq*ncol*sizeof(double));
+
+      for (t=0; t<w; t++){
+        ni = i + offset[t];
+        if (ni < 0 || ni >= nrow) continue;
+        gram_sums_row(V, images, valid, ni, q_x, q_xx, q_y, q_xy);
+      }
+
+
+      /** horizontal sums over the column stencil
+      +++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+
+      (*stencil)(H, V, nq, ncol, args->radius);
+
+
+      /** centered normal equations, nw samples (fill rows are zero)
+      +++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+
+      for (c=0; c<nc; c++){
+      for (d=0; d<=c; d++){
+        q = qxx[c*nc+d];
+        for (j=0; j<ncol; j++){
+          A[(c*nc+d)*ncol+j] = H[q*ncol+j] - H[(q_x+c)*ncol+j]*H[(q_x+d)*ncol+j]/nw;
+        }
+      }
+      }
+
+      for (b=0; b<nb; b++){
+      for (c=0; c<nc; c++){
+        q = q_xy+c*nb+b;
+        for (j=0; j<ncol; j++){
+          rhs[(b*nc+c)*ncol+j] = H[q*ncol+j] - H[(q_x+c)*ncol+j]*H[(q_y+b)*ncol+j]/nw;
+        }
+      }
+      }
+
+      (*solve)(A, rhs, tol, fail, nc, nb, ncol);
+
+
+      /** predict central pixel
+      +++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+
+      for (j=0; j<ncol; j++){
+
+        p = i*ncol+j;
+
+        if (!MASK_VALID(mask, p)){
+          for (b=0; b<nb; b++) images[SHARPENED].data[b][p] = images[LOWRES].meta.nodata;
+          continue;
+        }
+
+        if ((int)H[j] < nw/2){
+          for (b=0; b<nb; b++) images[SHARPENED].data[b][p] = images[LOWRES].meta.nodata;
+          mask_clear(mask, p);
+          continue;
+        }
+
+        // singular system, solve with ridge
+        if (fail[j]){
+
+          for (c=0; c<nc; c++){
+          for (d=0; d<nc; d++){
+            A1[c*nc+d] = H[qxx[c*nc+d]*ncol+j] - H[(q_x+c)*ncol+j]*H[(q_x+d)*ncol+j]/nw;
+          }
+          }
+
+          for (b=0; b<nb; b++){
+          for (c=0; c<nc; c++){
+            rhs1[b*nc+c] = H[(q_xy+c*nb+b)*ncol+j] - H[(q_x+c)*ncol+j]*H[(q_y+b)*ncol+j]/nw;
+          }
+          }
+
+          gram_solve(A1, rhs1, nc, nb);
+
+          for (b=0; b<nb; b++){
+          for (c=0; c<nc; c++){
+            rhs[(b*nc+c)*ncol+j] = rhs1[b*nc+c];
+          }
+          }
+
+        }
+
+        for (b=0; b<nb; b++){
+          for (c=0, pred=H[(q_y+b)*ncol+j]/nw; c<nc; c++){
+            pred += (images[PCA].data[c][p] - H[(q_x+c)*ncol+j]/nw) * rhs[(b*nc+c)*ncol+j];
+          }
+          images[SHARPENED].data[b][p] = pred;
+        }
+
+      }
+
+      // spectral fit of the row, while it is still in cache
+      if (fused != NULL) apply_spectral(fused, &sw, i*ncol, ncol);
+
+    }
+
+
+    /** clean
+    +++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+    free((void*)V);    free((void*)H);
+    free((void*)A);    free((void*)rhs);
+    free((void*)tol);  free((void*)fail);
+    free((void*)A1);   free((void*)rhs1);
+    if (fused != NULL) free_spectral_work(fused, &sw);
+
+  }
+
+
+  free((void*)offset);
+  free((void*)qxx);
+
+  return SUCCESS;
+}
+
+
+/** Accumulate the cross-products of one image row
++++ This function adds count, PCA, PCA x PCA, LOWRES and PCA x LOWRES of
++++ all valid pixels of one image row to the vertical sums. 
+--- V:      vertical sums (nq x ncol)
+--- images: images
+--- valid:  neighbor validity
+--- row:    image row
+--- q_*:    position of quantities in V
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+SIMD_CLONES
+void gram_sums_row(double *V, img_t *images, char *valid, int row, int q_x, int q_xx, int q_y, int q_xy){
+int b, c, d, j, q;
+int nc = images[PCA].meta.dim.band;
+int nb = images[LOWRES].meta.dim.band;
+int ncol = images[PCA].meta.dim.col;
+const char  *m = valid + row*ncol;
+const float *xc, *xd, *y;
+double *v;
+
+
+  v = V;
+  #pragma omp simd
+  for (j=0; j<ncol; j++) v[j] += m[j] ? 1.0 : 0.0;
+
+  for (c=0, q=q_xx; c<nc; c++){
+
+    xc = images[PCA].data[c] + row*ncol;
+
+    v = V + (q_x+c)*ncol;
+    #pragma omp simd
+    for (j=0; j<ncol; j++) v[j] += m[j] ? (double)xc[j] : 0.0;
+
+    for (d=c; d<nc; d++, q++){
+      xd = images[PCA].data[d] + row*ncol;
+      v = V + q*ncol;
+      #pragma omp simd
+      for (j=0; j<ncol; j++) v[j] += m[j] ? (double)xc[j]*xd[j] : 0.0;
+    }
+
+  }
+
+  for (b=0; b<nb; b++){
+    y = images[LOWRES].data[b] + row*ncol;
+    v = V + (q_y+b)*ncol;
+    #pragma omp simd
+    for (j=0; j<ncol; j++) v[j] += m[j] ? (double)y[j] : 0.0;
+  }
+
+  for (c=0, q=q_xy; c<nc; c++){
+    xc = images[PCA].data[c] + row*ncol;
+    for (b=0; b<nb; b++, q++){
+      y = images[LOWRES].data[b] + row*ncol;
+      v = V + q*ncol;
+      #pragma omp simd
+      for (j=0; j<ncol; j++) v[j] += m[j] ? (double)xc[j]*y[j] : 0.0;
+    }
+  }
+
+  return;
+}
+
+
+/** Kernel sums along the column stencil
++++ This function sums the vertical sums of one row over the column
++++ stencil. Columns that are at least r^2 away from the image edge are
++++ summed without bounds checks. The kernel is instantiated with compile-
++++ time radius (1-4), which lets the compiler unroll the taps with 
++++ constant offsets; stencil_sums is the generic instantiation.
+--- H:      kernel sums (nq x ncol, returned)
+--- V:      vertical sums (nq x ncol)
+--- nq:     number of summed quantities
+--- ncol:   number of columns
+--- radius: kernel radius
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+static ALWAYS_INLINE void stencil_sums_kernel(double *H, const double *V, int nq, int ncol, int radius){
+int q, t, j, nj, w = 2*radius+1;
+int reach = radius*radius;
+int jlo = (reach < ncol) ? reach : ncol;
+int jhi = (ncol-reach > jlo) ? ncol-reach : jlo;
+const double *v;
+double *h, sum;
+
+
+  for (q=0; q<nq; q++){
+
+    v = V + q*ncol;
+    h = H + q*ncol;
+
+    // interior
+    #pragma omp simd private(t,sum)
+    for (j=jlo; j<jhi; j++){
+      for (t=0, sum=0; t<w; t++) sum += v[j+STENCIL_OFFSET(t, radius)];
+      h[j] = sum;
+    }
+
+    // left and right border
+    for (j=0; j<ncol; j++){
+
+      if (j == jlo) j = jhi;
+      if (j >= ncol) break;
+
+      for (t=0, sum=0; t<w; t++){
+        nj = j + STENCIL_OFFSET(t, radius);
+        if (nj >= 0 && nj < ncol) sum += v[nj];
+      }
+      h[j] = sum;
+
+    }
+
+  }
+
+  return;
+}
+
+SIMD_CLONES
+void stencil_sums(double *H, const double *V, int nq, int ncol, int radius){
+  stencil_sums_kernel(H, V, nq, ncol, radius);
+}
+
+#define STENCIL_SUMS_R(R) \
+SIMD_CLONES \
+void stencil_sums_##R(double *H, const double *V, int nq, int ncol, int radius){ \
+  stencil_sums_kernel(H, V, nq, ncol, R); \
+}
+
+STENCIL_SUMS_R(1)
+STENCIL_SUMS_R(2)
+STENCIL_SUMS_R(3)
+STENCIL_SUMS_R(4)
+
+
+/** Solve a batch of symmetric normal equations
++++ This function solves A x = b for many small systems at once, each with
++++ multiple right-hand sides, using Cholesky decompositions. The systems
++++ are stored in structure-of-arrays layout, i.e. element (r,c) of all 
++++ systems is contiguous, such that each system occupies one SIMD lane. 
++++ Only the lower triangle of A is used, and is overwritten with the 
++++ decomposition; the right-hand sides are overwritten with the solutions.
++++ Systems that are not positive definite are flagged in fail; they need
++++ to be re-solved with gram_solve. The kernel is instantiated with 
++++ compile-time n (1-7 components, i.e. 2-8 predictors), which lets the 
++++ compiler fully unroll the loops over matrix elements; gram_solve_batch
++++ is the generic instantiation.
+--- A:      n x n x nlane matrices
+--- rhs:    nrhs x n x nlane right-hand sides
+--- tol:    nlane workspace
+--- fail:   nlane failure flags (returned)
+--- n:      number of unknowns
+--- nrhs:   number of right-hand sides
+--- nlane:  number of systems
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+static ALWAYS_INLINE void gram_solve_batch_kernel(double *A, double *rhs, double *tol, char *fail, int n, int nrhs, int nlane){
+int r, c, k, b, j;
+double *Lcc, *Lrc, *x, *xr;
+const double *Lck, *Lrk, *Lrr, *xc;
+
+
+  // pivots relative to the trace (same as gram_solve)
+  for (j=0; j<nlane; j++){ tol[j] = 0; fail[j] = 0; }
+  for (c=0; c<n; c++){
+    Lcc = A + (c*n+c)*nlane;
+    #pragma omp simd
+    for (j=0; j<nlane; j++) tol[j] += Lcc[j];
+  }
+  #pragma omp simd
+  for (j=0; j<nlane; j++) tol[j] *= 1e-12;
+
+
+  // decompose A = L L^T
+  for (c=0; c<n; c++){
+
+    Lcc = A + (c*n+c)*nlane;
+
+    for (k=0; k<c; k++){
+      Lck = A + (c*n+k)*nlane;
+      #pragma omp simd
+      for (j=0; j<nlane; j++) Lcc[j] -= Lck[j]*Lck[j];
+    }
+
+    #pragma omp simd
+    for (j=0; j<nlane; j++){
+      if (!(Lcc[j] > tol[j])){ fail[j] = 1; Lcc[j] = 1.0; }
+      Lcc[j] = sqrt(Lcc[j]);
+    }
+
+    for (r=c+1; r<n; r++){
+
+      Lrc = A + (r*n+c)*nlane;
+
+      for (k=0; k<c; k++){
+        Lrk = A + (r*n+k)*nlane;
+        Lck = A + (c*n+k)*nlane;
+        #pragma omp simd
+        for (j=0; j<nlane; j++) Lrc[j] -= Lrk[j]*Lck[j];
+      }
+
+      #pragma omp simd
+      for (j=0; j<nlane; j++) Lrc[j] /= Lcc[j];
+
+    }
+
+  }
+
+
+  // forward and backward substitution
+  for (b=0; b<nrhs; b++){
+
+    x = rhs + b*n*nlane;
+
+    for (r=0; r<n; r++){
+      xr = x + r*nlane;
+      for (c=0; c<r; c++){
+        Lrc = A + (r*n+c)*nlane;
+        xc  = x + c*nlane;
+        #pragma omp simd
+        for (j=0; j<nlane; j++) xr[j] -= Lrc[j]*xc[j];
+      }
+      Lrr = A + (r*n+r)*nlane;
+      #pragma omp simd
+      for (j=0; j<nlane; j++) xr[j] /= Lrr[j];
+    }
+
+    for (r=n-1; r>=0; r--){
+      xr = x + r*nlane;
+      for (c=r+1; c<n; c++){
+        Lrc = A + (c*n+r)*nlane;
+        xc  = x + c*nlane;
+        #pragma omp simd
+        for (j=0; j<nlane; j++) xr[j] -= Lrc[j]*xc[j];
+      }
+      Lrr = A + (r*n+r)*nlane;
+      #pragma omp simd
+      for (j=0; j<nlane; j++) xr[j] /= Lrr[j];
+    }
+
+  }
+
+  return;
+}
 
 
+SIMD_CLONES
+void gram_solve_batch(double *A, double *rhs, double *tol, char *fail, int n, int nrhs, int nlane){
+  gram_solve_batch_kernel(A, rhs, tol, fail, n, nrhs, nlane);
+}
 
-int resolution_merge(img_t *images, args_t *args){
-int b = 0;
-int i, j, p, ii, jj, ni, nj, np;
-int w, nw, k, nv = images[PCA].meta.dim.band + 1;
-bool nodata;
-gsl_matrix *X, **cov;
-gsl_vector *x, **y, **c;
-gsl_multifit_linear_workspace **work;
-double chisq, est, err;
-time_t TIME;
+#define GRAM_SOLVE_BATCH_N(N) \
+SIMD_CLONES \
+void gram_solve_batch_##N(double *A, double *rhs, double *tol, char *fail, int n, int nrhs, int nlane){ \
+  gram_solve_batch_kernel(A, rhs, tol, fail, N, nrhs, nlane); \
+}
 
-  
-  time(&TIME);
+GRAM_SOLVE_BATCH_N(1)
+GRAM_SOLVE_BATCH_N(2)
+GRAM_SOLVE_BATCH_N(3)
+GRAM_SOLVE_BATCH_N(4)
+GRAM_SOLVE_BATCH_N(5)
+GRAM_SOLVE_BATCH_N(6)
+GRAM_SOLVE_BATCH_N(7)
+
+
+/** Solve symmetric normal equations
++++ This function solves A x = b for multiple right-hand sides with a 
++++ Cholesky decomposition. A is overwritten with the decomposition, the
++++ right-hand sides are overwritten with the solutions. If A is singular
++++ (e.g. a component is constant within the kernel), a small ridge is 
++++ added to the diagonal. If this fails, too, the solution is set to 0,
++++ i.e. the prediction falls back to the kernel mean.
+--- A:      n x n matrix (row-major)
+--- rhs:    nrhs x n right-hand sides (row-major)
+--- n:      number of unknowns
+--- nrhs:   number of right-hand sides
++++ Return: SUCCESS/FAILURE
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int gram_solve(double *A, double *rhs, int n, int nrhs){
+int r, c, k, try;
+double sum, trace = 0, ridge = 0;
+double L[n*n];
 
-  printf("Starting Resolution Merge\n")  ;
 
+  for (c=0; c<n; c++) trace += A[c*n+c];
+  if (trace <= 0){
+    memset(rhs, 0, nrhs*n*sizeof(double));
+    return FAILURE;
+  }
 
+  for (try=0; try<2; try++){
 
-  // kernel size
-  w = 2 * args->radius + 1;
-  nw = w * w;
+    // decompose A = L L^T
+    for (c=0; c<n; c++){
+
+      for (k=0, sum=A[c*n+c]+ridge; k<c; k++) sum -= L[c*n+k]*L[c*n+k];
+      if (sum <= trace*1e-12) break;
+      L[c*n+c] = sqrt(sum);
+
+      for (r=c+1; r<n; r++){
+        for (k=0, sum=A[r*n+c]; k<c; k++) sum -= L[r*n+k]*L[c*n+k];
+        L[r*n+c] = sum / L[c*n+c];
+      }
+
+    }
+
+    if (c == n) break;
+
+    ridge = trace*1e-9;
+
+  }
+
+  if (try == 2){
+    memset(rhs, 0, nrhs*n*sizeof(double));
+    return FAILURE;
+  }
+
+  // forward and backward substitution
+  for (k=0; k<nrhs; k++){
+
+    double *x = rhs + k*n;
+
+    for (r=0; r<n; r++){
+      for (c=0, sum=x[r]; c<r; c++) sum -= L[r*n+c]*x[c];
+      x[r] = sum / L[r*n+r];
+    }
+
+    for (r=n-1; r>=0; r--){
+      for (c=r+1, sum=x[r]; c<n; c++) sum -= L[c*n+r]*x[c];
+      x[r] = sum / L[r*n+r];
+    }
+
+  }
 
-//gsl_set_error_handler_off();
-  #pragma omp parallel private(k,b,j,p,ii,jj,ni,nj,np,X,x,y,c,cov,work,chisq,est,err,nodata) shared(w,nw,nv,images,args) default(none)
+  return SUCCESS;
+}
+
+
+/** Check fast solvers against the SVD engine
++++ This function re-fits a sample of pixels with the SVD engine, which 
++++ uses GSL's SVD as reference, and reports the deviation of the sharpened
++++ values.
+--- images: images
+--- valid:  neighbor validity
+--- mask:   validity mask
+--- args:   arguments
++++ Return: SUCCESS/FAILURE
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int resmerge_check(img_t *images, char *valid, mask_t *mask, args_t *args){
+int b, i, j, p, step, n = 0, n_exceed = 0;
+int nw, nv = images[PCA].meta.dim.band + 1;
+int nb = images[LOWRES].meta.dim.band;
+double dev, rel, max_dev = 0, max_rel = 0, sum_sq = 0;
+svd_work_t work;
+double *pred = NULL;
+
+
+  nw = (2 * args->radius + 1) * (2 * args->radius + 1);
+
+  step = images[PCA].meta.dim.cell / CHECK_SAMPLES;
+  if (step < 1) step = 1;
+
+  #pragma omp parallel private(b,i,j,dev,rel,work,pred) shared(nw,nv,nb,step,valid,mask,images,args) reduction(+: n, n_exceed, sum_sq) reduction(max: max_dev, max_rel) default(none)
   {
 
-    /** initialize and allocate
-    +++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+    alloc_svd_work(&work, nw, nv, nb);
+    alloc((void**)&pred, nb, sizeof(double));
 
-    // nw-by-nv predictor variables; kernel + central pixel
-    X = gsl_matrix_calloc(nw, nv);
-    x = gsl_vector_calloc(nv);
+    #pragma omp for schedule(guided)
+    for (p=0; p<images[PCA].meta.dim.cell; p+=step){
 
-    // set first column of X to 1 -> intercept c0
-    for (k=0; k<nw; k++) gsl_matrix_set(X, k, 0, 1.0);
-    gsl_vector_set(x, 0, 1.0);
+      if (!MASK_VALID(mask, p)) continue;
 
-    // vector of nw observations
-    alloc((void**)&y, images[LOWRES].meta.dim.band, sizeof(gsl_vector*));
-    for (b=0; b<images[LOWRES].meta.dim.band; b++) y[b] = gsl_vector_calloc(nw);
+      i = p / images[PCA].meta.dim.col;
+      j = p % images[PCA].meta.dim.col;
 
-    // nv regression coefficients
-    alloc((void**)&c, images[LOWRES].meta.dim.band, sizeof(gsl_vector*));
-    for (b=0; b<images[LOWRES].meta.dim.band; b++) c[b] = gsl_vector_calloc(nv);
+      if (predict_svd(images, valid, args, i, j, &work, pred) == FAILURE) continue;
 
-    // nv-by-nv covariance matrix
-    alloc((void**)&cov, images[LOWRES].meta.dim.band, sizeof(gsl_matrix*));
-    for (b=0; b<images[LOWRES].meta.dim.band; b++) cov[b] = gsl_matrix_calloc(nv, nv);
+      for (b=0; b<nb; b++){
+        dev = fabs(images[SHARPENED].data[b][p] - pred[b]);
+        rel = dev / (fabs(pred[b]) > 1.0 ? fabs(pred[b]) : 1.0);
+        if (dev > max_dev) max_dev = dev;
+        if (rel > max_rel) max_rel = rel;
+        if (rel > CHECK_TOLERANCE) n_exceed++;
+        sum_sq += dev*dev;
+        n++;
+      }
 
-    // workspace
-    alloc((void**)&work, images[LOWRES].meta.dim.band, sizeof(gsl_multifit_linear_workspace*));
-    for (b=0; b<images[LOWRES].meta.dim.band; b++) work[b] = gsl_multifit_linear_alloc(nw, nv);
+    }
 
-    // sharpened dataset
-    alloc_2D((void***)&images[SHARPENED].data, images[LOWRES].meta.dim.band, images[LOWRES].meta.dim.cell, sizeof(float));
+    free_svd_work(&work);
+    free((void*)pred);
 
+  }
 
-    /** do regression for every valid pixel, and for each 20m band
-    +++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+  printf("Check against SVD reference (%d values):\n", n);
+  if (n == 0) return SUCCESS;
+  printf("  max. abs. deviation: %.4f\n", max_dev);
+  printf("  max. rel. deviation: %.2e\n", max_rel);
+  printf("  RMSD: %.4f\n", sqrt(sum_sq/n));
+  printf("  %d values exceed the relative tolerance of %.0e\n", n_exceed, CHECK_TOLERANCE);
 
-    #pragma omp for schedule(guided)  
+
+  return SUCCESS;
+}
+
+
+/** Number of grid nodes
++++ Grid nodes are placed every step pixels, and at the last pixel.
+--- n:      number of pixels
+--- step:   grid step
++++ Return: number of grid nodes
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int grid_nodes(int n, int step){
+
+
+  return (n - 1 + step - 1) / step + 1;
+}
+
+
+/** Pixel position of a grid node
+--- g:      grid node
+--- n:      number of pixels
+--- step:   grid step
++++ Return: pixel position
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int grid_position(int g, int n, int step){
+
+
+  return (g*step < n) ? g*step : n-1;
+}
+
+
+/** Grid cell of a pixel
++++ This function returns the enclosing grid nodes of a pixel and its
++++ interpolation weight.
+--- x:      pixel position
+--- n:      number of pixels
+--- step:   grid step
+--- g0:     lower grid node (returned)
+--- g1:     upper grid node (returned)
+--- w:      weight of the upper grid node (returned)
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void grid_cell(int x, int n, int step, int *g0, int *g1, double *w){
+int ng, x0, x1;
+
+
+  ng = grid_nodes(n, step);
+
+  *g0 = x / step;
+  *g1 = (*g0+1 < ng) ? *g0+1 : *g0;
+
+  x0 = grid_position(*g0, n, step);
+  x1 = grid_position(*g1, n, step);
+
+  *w = (x1 > x0) ? (double)(x-x0) / (x1-x0) : 0.0;
+
+  return;
+}
+
+
+/** Bilinear interpolation of coefficients
++++ This function interpolates the coefficients of the four grid nodes 
++++ enclosing a pixel. Nodes without a fit are skipped, and the weights of
++++ the remaining ones are renormalized.
+--- coef:   coefficients of the grid nodes
+--- ok:     fit status of the grid nodes
+--- node:   the four enclosing grid nodes (upper-left, upper-right,
+            lower-left, lower-right)
+--- wi:     row weight of the lower nodes
+--- wj:     column weight of the right nodes
+--- n:      coefficients per node
+--- out:    interpolated coefficients (returned)
++++ Return: SUCCESS/FAILURE (FAILURE: no enclosing node was fitted)
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int interpolate_coef(const float *coef, const char *ok, const int *node, double wi, double wj, int n, double *out){
+int c, k;
+double w[4], sum_w = 0;
+const float *src;
+
+
+  w[0] = (1-wi)*(1-wj);
+  w[1] = (1-wi)*wj;
+  w[2] = wi*(1-wj);
+  w[3] = wi*wj;
+
+  for (c=0; c<n; c++) out[c] = 0;
+
+  for (k=0; k<4; k++){
+
+    if (!ok[node[k]] || w[k] <= 0) continue;
+
+    src = coef + (size_t)node[k]*n;
+    for (c=0; c<n; c++) out[c] += w[k]*src[c];
+    sum_w += w[k];
+
+  }
+
+  if (sum_w <= 0) return FAILURE;
+
+  if (sum_w < 1) for (c=0; c<n; c++) out[c] /= sum_w;
+
+  return SUCCESS;
+}
+
+
+/** Number of valid kernel pixels
+--- images: images
+--- valid:  neighbor validity
+--- args:   arguments
+--- i:      row
+--- j:      column
++++ Return: number of valid kernel pixels
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int kernel_count(img_t *images, char *valid, args_t *args, int i, int j){
+int ii, jj, ni, nj, k = 0;
+
+
+  for (ii=-args->radius; ii<=args->radius; ii++){
+  for (jj=-args->radius; jj<=args->radius; jj++){
+
+    if (ii < 0) ni = i-ii*ii; else ni = i+ii*ii;
+    if (jj < 0) nj = j-jj*jj; else nj = j+jj*jj;
+
+    if (ni < 0 || ni >= images[PCA].meta.dim.row || nj < 0 || nj >= images[PCA].meta.dim.col) continue;
+
+    k += valid[ni*images[PCA].meta.dim.col+nj];
+
+  }
+  }
+
+  return k;
+}
+
+
+/** Apply regression coefficients to one pixel
+--- images: images
+--- p:      pixel
+--- coef:   nv coefficients for each LOWRES band
+--- nv:     number of predictors (incl. intercept)
+--- nb:     number of LOWRES bands
+--- pred:   prediction for each LOWRES band (returned)
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void apply_coef(img_t *images, int p, const double *coef, int nv, int nb, double *pred){
+int b, c;
+
+
+  for (b=0; b<nb; b++){
+    pred[b] = coef[b*nv];
+    for (c=1; c<nv; c++) pred[b] += coef[b*nv+c] * images[PCA].data[c-1][p];
+  }
+
+  return;
+}
+
+
+/** Resolution merge on a coarse grid
++++ This function fits the local regression only at the nodes of a grid 
++++ with a spacing of step pixels, using the SVD engine. The coefficients 
++++ of each pixel are bilinearly interpolated from the enclosing nodes, 
++++ and applied to the pixel's principal components. This reduces the 
++++ number of solves by about step^2. Pixels that are not enclosed by any
++++ fitted node are fitted directly.
+--- images: images
+--- valid:  neighbor validity
+--- mask:   validity mask
+--- args:   arguments
+--- fused:  spectral fit per tile, or NULL
++++ Return: SUCCESS/FAILURE
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int resmerge_grid(img_t *images, char *valid, mask_t *mask, args_t *args, spectral_t *fused){
+int b, i, j, p, g, k, n_direct = 0;
+int nw, nv = images[PCA].meta.dim.band + 1;
+int nb = images[LOWRES].meta.dim.band;
+int step = args->grid;
+int ngrow, ngcol, gi0, gi1, gj0, gj1, node[4];
+double wi, wj;
+float *coef = NULL;
+char *ok = NULL;
+double *dcoef = NULL, *pred = NULL;
+svd_work_t work;
+spectral_work_t sw;
+
+
+  nw = (2 * args->radius + 1) * (2 * args->radius + 1);
+
+  ngrow = grid_nodes(images[PCA].meta.dim.row, step);
+  ngcol = grid_nodes(images[PCA].meta.dim.col, step);
+
+  printf("fitting %d x %d grid nodes (step %d)\n", ngrow, ngcol, step);
+
+  alloc((void**)&coef, (size_t)ngrow*ngcol*nb*nv, sizeof(float));
+  alloc((void**)&ok,   ngrow*ngcol, sizeof(char));
+
+  #pragma omp parallel private(b,i,j,p,k,gi0,gi1,gj0,gj1,node,wi,wj,work,sw,dcoef,pred) shared(nw,nv,nb,step,ngrow,ngcol,coef,ok,valid,mask,images,args,fused) reduction(+: n_direct) default(none)
+  {
+
+    alloc_svd_work(&work, nw, nv, nb);
+    alloc((void**)&dcoef, nb*nv, sizeof(double));
+    alloc((void**)&pred, nb, sizeof(double));
+    if (fused != NULL) alloc_spectral_work(fused, &sw);
+
+    // fit grid nodes
+    #pragma omp for schedule(dynamic, 16)
+    for (g=0; g<ngrow*ngcol; g++){
+
+      i = grid_position(g / ngcol, images[PCA].meta.dim.row, step);
+      j = grid_position(g % ngcol, images[PCA].meta.dim.col, step);
+
+      if (coef_svd(images, valid, args, i, j, &work, dcoef) == FAILURE) continue;
+
+      for (k=0; k<nb*nv; k++) coef[(size_t)g*nb*nv+k] = (float)dcoef[k];
+      ok[g] = true;
+
+    }
+
+    // interpolate and apply coefficients
+    #pragma omp for schedule(guided)
     for (i=0; i<images[PCA].meta.dim.row; i++){
-    for (j=0; j<images[PCA].meta.dim.col; j++){
 
-      p = i*images[PCA].meta.dim.col+j;
+      grid_cell(i, images[PCA].meta.dim.row, step, &gi0, &gi1, &wi);
 
-      if (images[NODATA].data[0][p] < 0){
+      for (j=0; j<images[PCA].meta.dim.col; j++){
 
-        for (b=0; b<images[LOWRES].meta.dim.band; b++){
-          images[SHARPENED].data[b][p] = images[LOWRES].meta.nodata;
+        p = i*images[PCA].meta.dim.col+j;
+
+        if (!MASK_VALID(mask, p)){
+          for (b=0; b<nb; b++) images[SHARPENED].data[b][p] = images[LOWRES].meta.nodata;
+          continue;
         }
 
-        continue;
+        if (kernel_count(images, valid, args, i, j) < nw/2){
+          for (b=0; b<nb; b++) images[SHARPENED].data[b][p] = images[LOWRES].meta.nodata;
+          mask_clear(mask, p);
+          continue;
+        }
+
+        grid_cell(j, images[PCA].meta.dim.col, step, &gj0, &gj1, &wj);
+
+        node[0] = gi0*ngcol+gj0; node[1] = gi0*ngcol+gj1;
+        node[2] = gi1*ngcol+gj0; node[3] = gi1*ngcol+gj1;
+
+        if (interpolate_coef(coef, ok, node, wi, wj, nb*nv, dcoef) == SUCCESS){
+          apply_coef(images, p, dcoef, nv, nb, pred);
+        } else {
+          predict_svd(images, valid, args, i, j, &work, pred);
+          n_direct++;
+        }
+
+        for (b=0; b<nb; b++) images[SHARPENED].data[b][p] = (float)pred[b];
 
       }
 
-      // add central pixel
-      for (b=0; b<images[PCA].meta.dim.band; b++) gsl_vector_set(x, b+1, images[PCA].data[b][p]);
-      
-      k = 0;
+      // spectral fit of the row, while it is still in cache
+      if (fused != NULL) apply_spectral(fused, &sw, i*images[PCA].meta.dim.col, images[PCA].meta.dim.col);
+
+    }
 
-      // add neighboring pixels
-      for (ii=-args->radius; ii<=args->radius; ii++){
-      for (jj=-args->radius; jj<=args->radius; jj++){
+    free_svd_work(&work);
+    free((void*)dcoef);
+    free((void*)pred);
+    if (fused != NULL) free_spectral_work(fused, &sw);
 
-        
-        if (ii < 0) ni = i-ii*ii; else ni = i+ii*ii;
-        if (jj < 0) nj = j-jj*jj; else nj = j+jj*jj;
+  }
 
-        if (ni < 0 || ni >= images[PCA].meta.dim.row || nj < 0 || nj >= images[PCA].meta.dim.col) continue;
-        np = ni*images[PCA].meta.dim.col+nj;
+  if (n_direct > 0) printf("%d pixels without fitted grid node were fitted directly\n", n_direct);
 
-        if (images[NODATA].data[0][np] < 0) continue;
+  free((void*)coef);
+  free((void*)ok);
 
-        for (b=0, nodata=0; b<images[LOWRES].meta.dim.band; b++){
 
-          if (fequal(images[LOWRES].data[0][np], images[LOWRES].meta.nodata)){
-            nodata = true;
-            break;
-          }
+  return SUCCESS;
+}
+
+
+/** Check the coarse grid against the SVD engine
++++ This function reports the deviation of grid-interpolated coefficients
++++ from the per-pixel fit for several grid steps, on a sample of pixels.
++++ This helps to choose the grid step.
+--- images: images
+--- valid:  neighbor validity
+--- mask:   validity mask
+--- args:   arguments
++++ Return: SUCCESS/FAILURE
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int resmerge_check_grid(img_t *images, char *valid, mask_t *mask, args_t *args){
+int b, i, j, p, k, s, max_step, sample, n;
+int nw, nv = images[PCA].meta.dim.band + 1;
+int nb = images[LOWRES].meta.dim.band;
+int ngcol, gi0, gi1, gj0, gj1, node[4];
+char ok[4];
+double wi, wj, dev, max_dev, sum_sq, solves;
+float *coef = NULL;
+double *dcoef = NULL, *pred = NULL, *ref = NULL;
+svd_work_t work;
+
+
+  nw = (2 * args->radius + 1) * (2 * args->radius + 1);
+
+  sample = images[PCA].meta.dim.cell / GRID_CHECK_SAMPLES;
+  if (sample < 1) sample = 1;
+
+  max_step = (args->grid > GRID_CHECK_STEP) ? args->grid : GRID_CHECK_STEP;
+
+  printf("Quality vs. grid step, against per-pixel fit:\n");
+  printf("  step  solves/pixel        RMSD  max. abs. dev.  values\n");
+
+  for (s=2; s<=max_step; s++){
+
+    if (s > GRID_CHECK_STEP && s != args->grid) continue;
+
+    n = 0; max_dev = 0; sum_sq = 0;
+
+    ngcol = grid_nodes(images[PCA].meta.dim.col, s);
+    solves = (double)grid_nodes(images[PCA].meta.dim.row, s) * ngcol / images[PCA].meta.dim.cell;
+
+    #pragma omp parallel private(b,i,j,k,gi0,gi1,gj0,gj1,node,ok,wi,wj,dev,work,coef,dcoef,pred,ref) shared(s,nw,nv,nb,sample,ngcol,valid,mask,images,args) reduction(+: n, sum_sq) reduction(max: max_dev) default(none)
+    {
+
+      alloc_svd_work(&work, nw, nv, nb);
+      alloc((void**)&coef, 4*nb*nv, sizeof(float));
+      alloc((void**)&dcoef, nb*nv, sizeof(double));
+      alloc((void**)&pred, nb, sizeof(double));
+      alloc((void**)&ref, nb, sizeof(double));
+
+      #pragma omp for schedule(guided)
+      for (p=0; p<images[PCA].meta.dim.cell; p+=sample){
+
+        if (!MASK_VALID(mask, p)) continue;
 
-          gsl_vector_set(y[b], k, images[LOWRES].data[b][np]);
+        i = p / images[PCA].meta.dim.col;
+        j = p % images[PCA].meta.dim.col;
 
+        if (predict_svd(images, valid, args, i, j, &work, ref) == FAILURE) continue;
+
+        grid_cell(i, images[PCA].meta.dim.row, s, &gi0, &gi1, &wi);
+        grid_cell(j, images[PCA].meta.dim.col, s, &gj0, &gj1, &wj);
+
+        node[0] = gi0*ngcol+gj0; node[1] = gi0*ngcol+gj1;
+        node[2] = gi1*ngcol+gj0; node[3] = gi1*ngcol+gj1;
+
+        // fit the enclosing nodes
+        for (k=0; k<4; k++){
+          ok[k] = coef_svd(images, valid, args, 
+                    grid_position(node[k] / ngcol, images[PCA].meta.dim.row, s),
+                    grid_position(node[k] % ngcol, images[PCA].meta.dim.col, s),
+                    &work, dcoef) == SUCCESS;
+          for (b=0; b<nb*nv; b++) coef[k*nb*nv+b] = (float)dcoef[b];
+          node[k] = k;
         }
 
-        if (!nodata){
-          for (b=0; b<images[PCA].meta.dim.band; b++) gsl_matrix_set(X, k, b+1, images[PCA].data[b][np]);
-          k++;
+        if (interpolate_coef(coef, ok, node, wi, wj, nb*nv, dcoef) == FAILURE) continue;
+
+        apply_coef(images, p, dcoef, nv, nb, pred);
+
+        for (b=0; b<nb; b++){
+          dev = fabs(pred[b] - ref[b]);
+          if (dev > max_dev) max_dev = dev;
+          sum_sq += dev*dev;
+          n++;
         }
 
       }
-      }
 
-      if (k < nw/2){
+      free_svd_work(&work);
+      free((void*)coef);
+      free((void*)dcoef);
+      free((void*)pred);
+      free((void*)ref);
 
-        for (b=0; b<images[LOWRES].meta.dim.band; b++){
-          images[SHARPENED].data[b][p] = images[LOWRES].meta.nodata;
-        }
+    }
 
-        images[NODATA].data[0][p] = -10000.0;
+    if (n == 0) continue;
 
-        continue;
-        
-      }
+    printf("  %4d  %12.4f  %10.4f  %14.4f  %6d%s\n", 
+      s, solves, sqrt(sum_sq/n), max_dev, n, (s == args->grid) ? "  <- selected" : "");
+
+  }
+
+
+  return SUCCESS;
+}
+
+
+/** Native grid cell of a pixel
++++ This function returns the native-resolution pixels whose centers 
++++ enclose the center of a full-resolution pixel, and its interpolation
++++ weight. Outside of the outermost centers, the nearest one is used.
+--- x:      pixel position at full resolution
+--- n:      number of pixels at native resolution
+--- factor: resolution factor
+--- g0:     lower native pixel (returned)
+--- g1:     upper native pixel (returned)
+--- w:      weight of the upper native pixel (returned)
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void native_cell(int x, int n, int factor, int *g0, int *g1, double *w){
+double t;
+
+
+  t = (x + 0.5) / factor - 0.5;
+
+  if (t < 0)   t = 0;
+  if (t > n-1) t = n-1;
+
+  *g0 = (int)t;
+  *g1 = (*g0+1 < n) ? *g0+1 : *g0;
+  *w  = t - *g0;
+
+  return;
+}
+
+
+/** Resolution merge at native low resolution
++++ This function fits the local regression on the native grid of the
++++ LOWRES bands, in the style of area-to-point regression. The principal
++++ components are aggregated to the native grid first (mean of valid 
++++ pixels). The coefficients and residuals of the native fits are then 
++++ bilinearly interpolated to full resolution, and the coefficients are 
++++ applied to the full-resolution components. Adding the residuals 
++++ keeps the sharpened bands close to the observed LOWRES values.
+--- images: images
+--- mask:   validity mask
+--- args:   arguments
+--- fused:  spectral fit per tile, or NULL
++++ Return: SUCCESS/FAILURE
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int resmerge_native(img_t *images, mask_t *mask, args_t *args, spectral_t *fused){
+int b, i, j, p, ci, cj, cp, k, n;
+int nw, nv = images[PCA].meta.dim.band + 1;
+int nb = images[LOWRES].meta.dim.band;
+int nc = images[PCA].meta.dim.band;
+int factor = args->lowres, nn;
+int gi0, gi1, gj0, gj1, node[4];
+double wi, wj;
+img_t coarse[IMGLEN];
+char *valid = NULL, *ok = NULL;
+float *coef = NULL;
+double *sum = NULL, *dcoef = NULL, *pred = NULL;
+svd_work_t work;
+spectral_work_t sw;
+
+
+  nw = (2 * args->radius + 1) * (2 * args->radius + 1);
+
+  // coefficients + residuals per native pixel
+  nn = nb*nv + nb;
+
+  // native grid: aggregated components, LOWRES as is
+  memcpy(&coarse[LOWRES], &images[LOWRES], sizeof(img_t));
+  memcpy(&coarse[PCA].meta, &images[LOWRES].meta, sizeof(meta_t));
+  coarse[PCA].meta.dim.band = nc;
+  alloc_2D((void***)&coarse[PCA].data, nc, coarse[PCA].meta.dim.cell, sizeof(float));
+
+  alloc((void**)&valid, coarse[PCA].meta.dim.cell, sizeof(char));
+  alloc((void**)&ok,    coarse[PCA].meta.dim.cell, sizeof(char));
+  alloc((void**)&coef,  (size_t)coarse[PCA].meta.dim.cell*nn, sizeof(float));
+
+  printf("fitting %d x %d native pixels (factor %d)\n", 
+    coarse[PCA].meta.dim.row, coarse[PCA].meta.dim.col, factor);
+
+  #pragma omp parallel private(b,i,j,p,ci,cj,cp,k,n,gi0,gi1,gj0,gj1,node,wi,wj,work,sw,sum,dcoef,pred) shared(nw,nv,nb,nc,nn,factor,coarse,valid,ok,coef,mask,images,args,fused) default(none)
+  {
+
+    alloc_svd_work(&work, nw, nv, nb);
+    alloc((void**)&sum, nc, sizeof(double));
+    alloc((void**)&dcoef, nn, sizeof(double));
+    alloc((void**)&pred, nb, sizeof(double));
+    if (fused != NULL) alloc_spectral_work(fused, &sw);
+
+    // aggregate components, a native pixel is valid if at least half of
+    // its full-resolution pixels are
+    #pragma omp for schedule(guided)
+    for (ci=0; ci<coarse[PCA].meta.dim.row; ci++){
+    for (cj=0; cj<coarse[PCA].meta.dim.col; cj++){
+
+      cp = ci*coarse[PCA].meta.dim.col+cj;
 
+      for (b=0; b<nc; b++) sum[b] = 0;
 
-      // append zeros, if less than nw neighboring pixels were added
-      while (k < nw){
-        for (b=0; b<images[PCA].meta.dim.band; b++) gsl_matrix_set(X, k, b+1, 0.0);
-        for (b=0; b<images[LOWRES].meta.dim.band; b++) gsl_vector_set(y[b], k, 0.0);
+      for (i=ci*factor, n=0, k=0; i<(ci+1)*factor && i<images[PCA].meta.dim.row; i++){
+      for (j=cj*factor; j<(cj+1)*factor && j<images[PCA].meta.dim.col; j++){
+
+        p = i*images[PCA].meta.dim.col+j;
         k++;
-      }
 
-      // solve model, and predict central pixel
-      for (b=0; b<images[LOWRES].meta.dim.band; b++){
+        if (!MASK_VALID(mask, p)) continue;
 
-        gsl_multifit_linear(X, y[b], c[b], cov[b], &chisq, work[b]);
-        gsl_multifit_linear_est(x, c[b], cov[b], &est, &err);
-        images[SHARPENED].data[b][p] = est;
+        for (b=0; b<nc; b++) sum[b] += images[PCA].data[b][p];
+        n++;
 
       }
+      }
+
+      valid[cp] = 2*n >= k && 
+                  !fequal(coarse[LOWRES].data[0][cp], coarse[LOWRES].meta.nodata);
+
+      for (b=0; b<nc; b++) coarse[PCA].data[b][cp] = (n > 0) ? (float)(sum[b]/n) : 0;
 
     }
     }
 
+    // fit on native grid
+    #pragma omp for schedule(dynamic, 16)
+    for (cp=0; cp<coarse[PCA].meta.dim.cell; cp++){
 
-    /** clean
-    +++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
-    gsl_matrix_free (X); gsl_vector_free (x);
-    for (b=0; b<images[LOWRES].meta.dim.band; b++) gsl_vector_free(y[b]); 
-    for (b=0; b<images[LOWRES].meta.dim.band; b++) gsl_vector_free (c[b]); 
-    for (b=0; b<images[LOWRES].meta.dim.band; b++) gsl_matrix_free (cov[b]); 
-    for (b=0; b<images[LOWRES].meta.dim.band; b++) gsl_multifit_linear_free(work[b]); 
-    free((void*)y);      free((void*)c);
-    free((void*)cov);    free((void*)work);
+      if (!valid[cp]) continue;
+
+      ci = cp / coarse[PCA].meta.dim.col;
+      cj = cp % coarse[PCA].meta.dim.col;
+
+      if (coef_svd(coarse, valid, args, ci, cj, &work, dcoef) == FAILURE) continue;
+
+      // residual of the native pixel
+      apply_coef(coarse, cp, dcoef, nv, nb, pred);
+      for (b=0; b<nb; b++) dcoef[nb*nv+b] = coarse[LOWRES].data[b][cp] - pred[b];
+
+      for (k=0; k<nn; k++) coef[(size_t)cp*nn+k] = (float)dcoef[k];
+      ok[cp] = true;
+
+    }
+
+    // interpolate and apply at full resolution
+    #pragma omp for schedule(guided)
+    for (i=0; i<images[PCA].meta.dim.row; i++){
+
+      native_cell(i, coarse[PCA].meta.dim.row, factor, &gi0, &gi1, &wi);
+
+      for (j=0; j<images[PCA].meta.dim.col; j++){
+
+        p = i*images[PCA].meta.dim.col+j;
+
+        if (!MASK_VALID(mask, p)){
+          for (b=0; b<nb; b++) images[SHARPENED].data[b][p] = images[LOWRES].meta.nodata;
+          continue;
+        }
+
+        native_cell(j, coarse[PCA].meta.dim.col, factor, &gj0, &gj1, &wj);
+
+        node[0] = gi0*coarse[PCA].meta.dim.col+gj0; node[1] = gi0*coarse[PCA].meta.dim.col+gj1;
+        node[2] = gi1*coarse[PCA].meta.dim.col+gj0; node[3] = gi1*coarse[PCA].meta.dim.col+gj1;
+
+        if (interpolate_coef(coef, ok, node, wi, wj, nn, dcoef) == FAILURE){
+          for (b=0; b<nb; b++) images[SHARPENED].data[b][p] = images[LOWRES].meta.nodata;
+          mask_clear(mask, p);
+          continue;
+        }
+
+        apply_coef(images, p, dcoef, nv, nb, pred);
+
+        for (b=0; b<nb; b++) images[SHARPENED].data[b][p] = (float)(pred[b] + dcoef[nb*nv+b]);
+
+      }
+
+      // spectral fit of the row, while it is still in cache
+      if (fused != NULL) apply_spectral(fused, &sw, i*images[PCA].meta.dim.col, images[PCA].meta.dim.col);
+
+    }
+
+    free_svd_work(&work);
+    free((void*)sum);
+    free((void*)dcoef);
+    free((void*)pred);
+    if (fused != NULL) free_spectral_work(fused, &sw);
 
   }
 
-//  gsl_set_error_handler(NULL);
+  free_2D((void**)coarse[PCA].data, nc);
+  free((void*)valid);
+  free((void*)ok);
+  free((void*)coef);
 
 
-  memcpy(&images[SHARPENED].meta, &images[LOWRES].meta, sizeof(meta_t));
+  return SUCCESS;
+}
+
+
+/** Resolution merge
++++ This function sharpens the LOWRES bands with a local regression on the
++++ principal components of the HIGHRES bands. If requested, the spectral
++++ fit is fused into the same pass: each thread fits the pixels it has 
++++ just sharpened, while they are still in cache.
+--- images: images
+--- mask:   validity mask
+--- plan:   band plan
+--- args:   arguments
++++ Return: SUCCESS/FAILURE
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int resolution_merge(img_t *images, mask_t *mask, bandplan_t *plan, args_t *args){
+int p;
+char *valid = NULL;
+spectral_t sf, *fused = NULL;
+time_t TIME;
+
+  
+  time(&TIME);
+
+  printf("Starting Resolution Merge\n")  ;
+
+
+  // sharpened dataset, at full resolution
+  alloc_2D((void***)&images[SHARPENED].data, images[LOWRES].meta.dim.band, images[PCA].meta.dim.cell, sizeof(float));
+
+  memcpy(&images[SHARPENED].meta, &images[HIGHRES].meta, sizeof(meta_t));
+  images[SHARPENED].meta.dim.band = images[LOWRES].meta.dim.band;
+  images[SHARPENED].meta.nodata   = images[LOWRES].meta.nodata;
+
+  // spectral fit, fused into the resolution merge
+  if (args->fused){
+    printf("fusing spectral fit into resolution merge\n");
+    if (init_spectral(images, mask, plan, args, &sf)) fused = &sf;
+  }
+
+  if (args->lowres > 1){
+
+    resmerge_native(images, mask, args, fused);
+
+  } else {
+
+    // neighbor validity, frozen before pixels are flagged in the mask
+    alloc((void**)&valid, images[PCA].meta.dim.cell, sizeof(char));
+
+    #pragma omp parallel for shared(images,mask,valid) default(none)
+    for (p=0; p<images[PCA].meta.dim.cell; p++){
+      valid[p] = MASK_VALID(mask, p) && 
+                 !fequal(images[LOWRES].data[0][p], images[LOWRES].meta.nodata);
+    }
+
+    if (args->grid > 1){
+      resmerge_grid(images, valid, mask, args, fused);
+    } else if (args->solver == SOLVER_GRAM){
+      resmerge_gram(images, valid, mask, args, fused);
+    } else {
+      resmerge_svd(images, valid, mask, args, fused);
+    }
+
+    if (args->check){
+      if (args->grid > 1){
+        resmerge_check_grid(images, valid, mask, args);
+      } else if (args->solver != SOLVER_SVD && args->fused){
+        // SHARPENED was already replaced by the spectral fit
+        printf("check of solver skipped, not available with fused spectral fit\n");
+      } else if (args->solver != SOLVER_SVD){
+        resmerge_check(images, valid, mask, args);
+      }
+    }
+
+    free((void*)valid);
+
+  }
+
+  if (fused != NULL) free_spectral(fused);
 
   proctime_print("Resolution merge", TIME);
 
   
   return SUCCESS;
 }
+
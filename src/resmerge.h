@@ -31,11 +31,15 @@ Enhance spatial resolution header
 #include <stdio.h>   // core input and output functions
 #include <stdlib.h>  // standard general utilities library
 #include <stdbool.h> // boolean data type
+#include <unistd.h>  // standard symbolic constants and types
 
 #include "dtype.h"
 #include "alloc.h"
 #include "utils.h"
 #include "table.h"
+#include "bandplan.h"
+#include "spectralfit.h"
+#include "mask.h"
 
 
 
@@ -43,7 +47,7 @@ Enhance spatial resolution header
 extern "C" {
 #endif
 
-int resolution_merge(img_t *images, args_t *args);
+int resolution_merge(img_t *images, mask_t *mask, bandplan_t *plan, args_t *args);
 
 #ifdef __cplusplus
 }
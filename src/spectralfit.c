@@ -29,159 +29,524 @@ This file contains functions to enhance spatial resolution
 
 /** GNU Scientific Library (GSL) **/
 #include <gsl/gsl_math.h>
+#include <gsl/gsl_errno.h>
 #include <gsl/gsl_bspline.h>
 #include <gsl/gsl_rng.h>
 #include <gsl/gsl_randist.h>
 #include <gsl/gsl_statistics.h>
 
 
-int spectral_fit(img_t *images, table_t *bandlist, args_t *args){
-int b, b_vector, b_highres, b_sharpened, b_spectralfit;
-int p;
-int nb = images[HIGHRES].meta.dim.band + images[SHARPENED].meta.dim.band;
+
+int spectral_operator(bandplan_t *plan, args_t *args, uint64_t mask, double *M);
+uint64_t band_mask(float **in, float *nodata, int nb_in, int p);
+int cache_find(operator_cache_t *cache, int from, int to, uint64_t mask);
+double *cache_operator(spectral_t *sf, spectral_work_t *work, uint64_t mask);
+void free_cache(operator_cache_t *cache);
+
+
+/** Spectral fit operator
++++ This function computes the matrix that maps the input bands of a pixel
++++ onto the B-spline fit at all output wavelengths. The input wavelengths
++++ are the same for every pixel, and the least-squares fit is linear in 
++++ the observations. Thus, column k of the operator is the fit of the 
++++ k-th unit vector, evaluated at the output wavelengths. Only input bands
++++ that are set in the validity mask are used, the columns of the others
++++ are zero.
+--- plan:   band plan
+--- args:   arguments
+--- mask:   validity mask of input bands
+--- M:      nb_out x nb_in operator (returned)
++++ Return: SUCCESS/FAILURE
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int spectral_operator(bandplan_t *plan, args_t *args, uint64_t mask, double *M){
+int k, o, n, b_vector, status = GSL_SUCCESS;
+int nb_in = plan->nb_in, nb_out = plan->nb_out;
 gsl_vector *x, *y, *c;
 gsl_bspline_workspace *work;
 double chisq, est;
-time_t TIME;
+size_t control_points;
 
-double min_wavelength;
-double max_wavelength;
 
-size_t control_points;
+  for (k=0, n=0; k<nb_in; k++){
+    if (mask & ((uint64_t)1 << k)) n++;
+  }
 
-gsl_rng *rng;
+  for (k=0; k<nb_out*nb_in; k++) M[k] = 0;
 
-int col_use, col_band, col_wavelength;
+  if (n == 0) return FAILURE;
 
-  time(&TIME);
+  // workspace
+  work = gsl_bspline_alloc(args->order, args->nbreak);
+  gsl_bspline_init_uniform(plan->min_wavelength, plan->max_wavelength, work);
 
-  printf("Starting Spectral Fit\n")  ;
+  // number of control points
+  control_points = gsl_bspline_ncontrol(work);
 
+  // input wavelengths
+  x = gsl_vector_alloc(n);
+  y = gsl_vector_alloc(n);
+  c = gsl_vector_calloc(control_points);
 
-  if ((col_use  = find_table_col(bandlist, "use")) < 0){
-    printf("there is no column 'use' in csv-file\n");
-    exit(FAILURE);
+  for (k=0, b_vector=0; k<nb_in; k++){
+    if (mask & ((uint64_t)1 << k)) gsl_vector_set(x, b_vector++, plan->in_wavelength[k]);
   }
-  if ((col_band = find_table_col(bandlist, "band")) < 0){
-    printf("there is no column 'use' in csv-file\n");
-    exit(FAILURE);
+
+  // fit unit vectors, and evaluate at output wavelengths
+  for (k=0, b_vector=0; k<nb_in; k++){
+
+    if (!(mask & ((uint64_t)1 << k))) continue;
+
+    gsl_vector_set_basis(y, b_vector++);
+
+    if ((status = gsl_bspline_lssolve(x, y, c, &chisq, work)) != GSL_SUCCESS) break;
+
+    for (o=0; o<nb_out; o++){
+      gsl_bspline_calc(plan->out_wavelength[o], c, &est, work);
+      M[o*nb_in+k] = est;
+    }
+
   }
-  if ((col_wavelength = find_table_col(bandlist, "wavelength")) < 0){
-    printf("there is no column 'wavelength' in csv-file\n");
-    exit(FAILURE);
+
+  gsl_vector_free(x);
+  gsl_vector_free(y); 
+  gsl_vector_free(c); 
+  gsl_bspline_free(work);
+
+  if (status != GSL_SUCCESS) return FAILURE;
+
+  return SUCCESS;
+}
+
+
+/** Validity mask of a pixel
++++ This function returns a bitmask of the input bands, bit k is set if 
++++ input band k is not nodata.
+--- in:     input bands
+--- nodata: nodata value of input bands
+--- nb_in:  number of input bands
+--- p:      pixel
++++ Return: validity mask
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+uint64_t band_mask(float **in, float *nodata, int nb_in, int p){
+uint64_t mask = 0;
+int k;
+
+
+  for (k=0; k<nb_in; k++){
+    if (!fequal(in[k][p], nodata[k])) mask |= (uint64_t)1 << k;
   }
 
-  memcpy(&images[SPECTRALFIT].meta, &images[HIGHRES].meta, sizeof(meta_t));
+  return mask;
+}
+
+
+/** Find operator in cache
+--- cache:  operator cache
+--- from:   first entry to search
+--- to:     last entry to search (excluded)
+--- mask:   validity mask
++++ Return: index of operator, -1 if not cached
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int cache_find(operator_cache_t *cache, int from, int to, uint64_t mask){
+int i;
+
 
-  for (b=0, images[SPECTRALFIT].meta.dim.band=0; b<bandlist->nrow; b++){
-    if ((int)bandlist->data[b][col_use] == 0) images[SPECTRALFIT].meta.dim.band++;
+  for (i=from; i<to; i++){
+    if (cache->chunk[i/CACHE_CHUNK][i%CACHE_CHUNK].mask == mask) return i;
   }
 
-  // nothing to do here
-  if (images[SPECTRALFIT].meta.dim.band == 0) return(SUCCESS);
-
-  for (b=0, min_wavelength=DBL_MAX, max_wavelength=DBL_MIN; b<bandlist->nrow; b++){
-    if ((int)bandlist->data[b][col_use] == 1 || 
-        (int)bandlist->data[b][col_use] == 2 ||
-        (int)bandlist->data[b][col_use] == 0){
-      if (bandlist->data[b][col_wavelength] < min_wavelength) min_wavelength = bandlist->data[b][col_wavelength];
-      if (bandlist->data[b][col_wavelength] > max_wavelength) max_wavelength = bandlist->data[b][col_wavelength];
+  return -1;
+}
+
+
+/** Operator of a validity mask
++++ This function returns the cached operator of a validity mask. If the
++++ mask is not cached yet, the operator is computed and added. The cache
++++ is shared by all threads. Entries are stored in chunks that are never
++++ moved, and an entry is published by incrementing the count only after
++++ its operator is complete; thus, published entries are searched without
++++ lock, and the lock is only taken on a miss. The last hit is kept in the
++++ thread's workspace, as neighboring pixels tend to share their mask.
++++ GSL's error handler is switched off while building, masks that cannot
++++ be fitted (e.g. too few bands) are cached as failed. If the cache is 
++++ full, the operator is computed into the workspace.
+--- sf:     spectral fit
+--- work:   workspace
+--- mask:   validity mask
++++ Return: operator, NULL if it could not be computed
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+double *cache_operator(spectral_t *sf, spectral_work_t *work, uint64_t mask){
+operator_cache_t *cache = &sf->cache;
+cache_entry_t *entry = NULL;
+gsl_error_handler_t *handler = NULL;
+double *M = NULL;
+int i, n;
+
+
+  if (mask == work->last) return work->M_last;
+
+  #pragma omp atomic read
+  n = cache->n;
+  #pragma omp flush
+
+  if ((i = cache_find(cache, 0, n, mask)) >= 0){
+
+    entry = &cache->chunk[i/CACHE_CHUNK][i%CACHE_CHUNK];
+    if (entry->ok) M = entry->M;
+
+  } else {
+
+    #pragma omp critical (spectral_cache)
+    {
+
+      // entries that were published in the meantime
+      if ((i = cache_find(cache, n, cache->n, mask)) >= 0){
+
+        entry = &cache->chunk[i/CACHE_CHUNK][i%CACHE_CHUNK];
+        if (entry->ok) M = entry->M;
+
+      } else if (cache->n < CACHE_CHUNK*CACHE_NCHUNK){
+
+        i = cache->n;
+        if (i%CACHE_CHUNK == 0) alloc((void**)&cache->chunk[i/CACHE_CHUNK], CACHE_CHUNK, sizeof(cache_entry_t));
+
+        entry = &cache->chunk[i/CACHE_CHUNK][i%CACHE_CHUNK];
+        entry->mask = mask;
+        alloc((void**)&entry->M, sf->nb_out*sf->nb_in, sizeof(double));
+
+        handler = gsl_set_error_handler_off();
+        entry->ok = spectral_operator(sf->plan, sf->args, mask, entry->M) == SUCCESS;
+        gsl_set_error_handler(handler);
+
+        if (entry->ok) M = entry->M;
+
+        // publish complete entry
+        #pragma omp flush
+        #pragma omp atomic write
+        cache->n = i+1;
+
+      } else {
+
+        handler = gsl_set_error_handler_off();
+        if (spectral_operator(sf->plan, sf->args, mask, work->M) == SUCCESS) M = work->M;
+        gsl_set_error_handler(handler);
+
+      }
+
     }
+
+  }
+
+  work->last   = mask;
+  work->M_last = M;
+
+  return M;
+}
+
+
+/** Free operator cache
+--- cache:  operator cache
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void free_cache(operator_cache_t *cache){
+int i;
+
+
+  for (i=0; i<cache->n; i++) free((void*)cache->chunk[i/CACHE_CHUNK][i%CACHE_CHUNK].M);
+
+  for (i=0; i<CACHE_NCHUNK; i++){
+    if (cache->chunk[i] != NULL) free((void*)cache->chunk[i]);
+    cache->chunk[i] = NULL;
   }
 
+  cache->n = 0;
+
+  return;
+}
+
+
+/** Initialize spectral fit
++++ This function computes the spectral fit operator, and connects the
++++ input and output bands in bandlist order. The highres and sharpened 
++++ bands must be allocated; the predicted bands are allocated here.
+--- images: images
+--- mask:   validity mask
+--- plan:   band plan
+--- args:   arguments
+--- sf:     spectral fit (returned)
++++ Return: true if there is something to fit
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+bool init_spectral(img_t *images, mask_t *mask, bandplan_t *plan, args_t *args, spectral_t *sf){
+gsl_error_handler_t *handler = NULL;
+int k, o, status;
+
+
+  memset(sf, 0, sizeof(spectral_t));
+
+  memcpy(&images[SPECTRALFIT].meta, &images[HIGHRES].meta, sizeof(meta_t));
+  images[SPECTRALFIT].meta.dim.band = plan->n_spectral;
+
+  // nothing to do here
+  if (images[SPECTRALFIT].meta.dim.band == 0) return false;
+
   alloc_2D((void***)&images[SPECTRALFIT].data, images[SPECTRALFIT].meta.dim.band, images[SPECTRALFIT].meta.dim.cell, sizeof(float));
 
+  sf->plan    = plan;
+  sf->args    = args;
+  sf->nb_in   = plan->nb_in;
+  sf->nb_out  = plan->nb_out;
+  sf->partial = args->partial;
+  sf->mask    = mask;
 
-  #pragma omp parallel private(b,b_highres,b_sharpened,b_spectralfit,b_vector,p,x,y,c,work,chisq,est,rng,control_points) shared(nb,images,bandlist,col_use, col_wavelength,args,min_wavelength,max_wavelength,gsl_rng_default) default(none)
-  {
+  if (sf->partial && sf->nb_in > MASK_BANDS){
+    printf("partial spectral fit supports up to %d input bands, disabled.\n", MASK_BANDS);
+    sf->partial = false;
+  }
 
-    /** initialize and allocate
-    +++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+  // input and output bands, in bandlist order
+  alloc((void**)&sf->in,        sf->nb_in,  sizeof(float*));
+  alloc((void**)&sf->out,       sf->nb_out, sizeof(float*));
+  alloc((void**)&sf->nodata_in, sf->nb_in,  sizeof(float));
+  alloc((void**)&sf->nodata,    sf->nb_out, sizeof(float));
 
-    gsl_rng_env_setup();
-    rng = gsl_rng_alloc(gsl_rng_default);
+  for (k=0; k<sf->nb_in; k++){
+    sf->in[k] = images[plan->in_image[k]].data[plan->in_index[k]];
+    sf->nodata_in[k] = images[plan->in_image[k]].meta.nodata;
+  }
 
-    // workspace
-    work = gsl_bspline_alloc(args->order, args->nbreak);
-    gsl_bspline_init_uniform(min_wavelength, max_wavelength, work);
+  for (o=0; o<sf->nb_out; o++){
+    sf->out[o] = images[plan->out_image[o]].data[plan->out_index[o]];
+    sf->nodata[o] = images[plan->out_image[o]].meta.nodata;
+  }
 
-    // number of control points
-    control_points = gsl_bspline_ncontrol(work);
+  sf->full = (sf->nb_in < MASK_BANDS) ? ((uint64_t)1 << sf->nb_in) - 1 : ~(uint64_t)0;
 
+  // fit operator
+  alloc((void**)&sf->M, sf->nb_out*sf->nb_in, sizeof(double));
 
-    // vector of nb observations
-    x = gsl_vector_alloc(nb);
-    y = gsl_vector_alloc(nb);
+  handler = gsl_set_error_handler_off();
+  status = spectral_operator(plan, args, sf->full, sf->M);
+  gsl_set_error_handler(handler);
 
-    // nv regression coefficients
-    c = gsl_vector_calloc(control_points);
+  if (status != SUCCESS){
+    printf("unable to compute spectral fit with %d input bands, ", sf->nb_in);
+    printf("%d breakpoints and order %d.\n", args->nbreak, args->order);
+    exit(FAILURE);
+  }
 
+  return true;
+}
 
-    #pragma omp for schedule(guided)  
-    for (p=0; p<images[HIGHRES].meta.dim.cell; p++){
-
-      if (images[NODATA].data[0][p] < 0){
-
-        for (b=0, b_highres=0, b_sharpened=0, b_spectralfit=0; b<bandlist->nrow; b++){
-
-          if ((int)bandlist->data[b][col_use] == 0){
-          }
-          if ((int)bandlist->data[b][col_use] == 1){
-            images[HIGHRES].data[b_highres++][p] = images[HIGHRES].meta.nodata;
-          } else if ((int)bandlist->data[b][col_use] == 2){
-            images[SHARPENED].data[b_sharpened++][p] = images[SHARPENED].meta.nodata;
-          } else if ((int)bandlist->data[b][col_use] == 0){
-            images[SPECTRALFIT].data[b_spectralfit++][p] = images[SPECTRALFIT].meta.nodata;
-          }
-          
-        }
 
-        continue;
-      } 
+/** Free spectral fit
++++ This function frees the spectral fit, and reports on partially valid
++++ pixels.
+--- sf:     spectral fit
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void free_spectral(spectral_t *sf){
+
+
+  if (sf->partial){
+    printf("%d partially valid pixels fitted with %d distinct masks, %d failed\n", 
+      sf->n_partial, sf->cache.n, sf->n_failed);
+  }
+
+  free_cache(&sf->cache);
+  if (sf->M         != NULL) free((void*)sf->M);
+  if (sf->in        != NULL) free((void*)sf->in);
+  if (sf->out       != NULL) free((void*)sf->out);
+  if (sf->nodata_in != NULL) free((void*)sf->nodata_in);
+  if (sf->nodata    != NULL) free((void*)sf->nodata);
+
+  return;
+}
+
+
+/** Allocate spectral fit workspace
+--- sf:     spectral fit
+--- work:   workspace (returned)
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void alloc_spectral_work(spectral_t *sf, spectral_work_t *work){
+
+
+  work->nb_out = sf->nb_out;
+  work->n_partial = 0;
+  work->n_failed = 0;
+  work->last = 0;
+  work->M_last = NULL;
+
+  // fit of one chunk, the bands are overwritten in place
+  alloc_2D((void***)&work->fit, sf->nb_out, SPECTRAL_CHUNK, sizeof(double));
+  alloc((void**)&work->pix, sf->nb_out, sizeof(double));
+  alloc((void**)&work->M, sf->nb_out*sf->nb_in, sizeof(double));
+
+  return;
+}
+
+
+/** Free spectral fit workspace
++++ This function frees the workspace, and adds its counts to the spectral
++++ fit.
+--- sf:     spectral fit
+--- work:   workspace
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void free_spectral_work(spectral_t *sf, spectral_work_t *work){
+
+
+  #pragma omp atomic
+  sf->n_partial += work->n_partial;
+  #pragma omp atomic
+  sf->n_failed += work->n_failed;
+
+  free_2D((void**)work->fit, work->nb_out);
+  free((void*)work->pix);
+  free((void*)work->M);
+
+  return;
+}
+
+
+/** Apply spectral fit
++++ This function applies the spectral fit to a contiguous range of pixels,
++++ in chunks, as a matrix product over the band-major arrays. Pixels with
++++ some invalid input bands are fitted with the operator of their mask, 
++++ if enabled, else they are nodata.
+--- sf:     spectral fit
+--- work:   workspace
+--- p0:     first pixel
+--- np:     number of pixels
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void apply_spectral(spectral_t *sf, spectral_work_t *work, int p0, int np){
+int k, o, p, q0, nq;
+int nb_in = sf->nb_in, nb_out = sf->nb_out;
+double **fit = work->fit, *pix = work->pix, *Mp = NULL, m, est;
+uint64_t mask;
+
+
+  for (q0=p0; q0<p0+np; q0+=SPECTRAL_CHUNK){
 
-      for (b=0, b_vector=0, b_highres=0, b_sharpened=0; b<bandlist->nrow; b++){
+    nq = (q0+SPECTRAL_CHUNK > p0+np) ? p0+np-q0 : SPECTRAL_CHUNK;
 
-        if ((int)bandlist->data[b][col_use] == 1){
-          gsl_vector_set(y, b_vector, images[HIGHRES].data[b_highres++][p]);
-        } else if ((int)bandlist->data[b][col_use] == 2){
-          gsl_vector_set(y, b_vector, images[SHARPENED].data[b_sharpened++][p]);
+    // no valid pixel in this chunk
+    if (!sf->partial && !mask_any(sf->mask, q0, nq)){
+      for (o=0; o<nb_out; o++){
+        for (p=0; p<nq; p++) sf->out[o][q0+p] = sf->nodata[o];
+      }
+      continue;
+    }
+
+    // fit = M in
+    for (o=0; o<nb_out; o++){
+
+      for (p=0; p<nq; p++) fit[o][p] = 0;
+
+      for (k=0; k<nb_in; k++){
+        m = sf->M[o*nb_in+k];
+        #pragma omp simd
+        for (p=0; p<nq; p++) fit[o][p] += m*sf->in[k][q0+p];
+      }
+
+    }
+
+    for (p=0; p<nq; p++){
+
+      if (!sf->partial){
+
+        if (!MASK_VALID(sf->mask, q0+p)){
+          for (o=0; o<nb_out; o++) sf->out[o][q0+p] = sf->nodata[o];
         } else {
-          continue;
+          for (o=0; o<nb_out; o++) sf->out[o][q0+p] = (float)fit[o][p];
         }
 
-        gsl_vector_set(x, b_vector++, bandlist->data[b][col_wavelength]); 
+        continue;
 
       }
 
-      gsl_bspline_lssolve(x, y, c, &chisq, work);
+      // partial validity: operator of the pixel's mask
+      if ((mask = band_mask(sf->in, sf->nodata_in, nb_in, q0+p)) == sf->full){
+        for (o=0; o<nb_out; o++) sf->out[o][q0+p] = (float)fit[o][p];
+        continue;
+      }
+
+      if (mask == 0 || (Mp = cache_operator(sf, work, mask)) == NULL){
+        for (o=0; o<nb_out; o++) sf->out[o][q0+p] = sf->nodata[o];
+        if (mask != 0) work->n_failed++;
+        continue;
+      }
 
-      for (b=0, b_highres=0, b_sharpened=0, b_spectralfit=0; b<bandlist->nrow; b++){
-        gsl_bspline_calc(bandlist->data[b][col_wavelength], c, &est, work);
-        if ((int)bandlist->data[b][col_use] == 1){
-          images[HIGHRES].data[b_highres++][p] = (float)est;
-        } else if ((int)bandlist->data[b][col_use] == 2){
-          images[SHARPENED].data[b_sharpened++][p] = (float)est;
-        } else if ((int)bandlist->data[b][col_use] == 0){
-          images[SPECTRALFIT].data[b_spectralfit++][p] = (float)est;
+      for (o=0; o<nb_out; o++){
+        for (k=0, est=0; k<nb_in; k++){
+          if (mask & ((uint64_t)1 << k)) est += Mp[o*nb_in+k]*sf->in[k][q0+p];
         }
+        pix[o] = est;
       }
 
+      for (o=0; o<nb_out; o++) sf->out[o][q0+p] = (float)pix[o];
+      work->n_partial++;
+
     }
 
+  }
+
+  return;
+}
+
+
+/** Spectral fit
++++ This function fits a B-spline to the highres and sharpened bands of
++++ each pixel, and replaces them by the fit; bands with usage code 0 are
++++ predicted, and wavelengths with usage code 3 are synthesized. As the 
++++ fit is one fixed linear operator, it is computed once, and applied to
++++ chunks of pixels as a matrix product over the band-major arrays. 
++++ Optionally, pixels with some invalid input bands are fitted with the
++++ remaining bands: an operator is computed for each distinct validity 
++++ mask, and kept in a cache.
+--- images: images
+--- mask:   validity mask
+--- plan:   band plan
+--- args:   arguments
++++ Return: SUCCESS/FAILURE
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int spectral_fit(img_t *images, mask_t *mask, bandplan_t *plan, args_t *args){
+int chunk, n_chunk, cell = images[HIGHRES].meta.dim.cell;
+spectral_t sf;
+spectral_work_t work;
+time_t TIME;
+
+  time(&TIME);
+
+  printf("Starting Spectral Fit\n")  ;
+
 
-    /** clean
-    +++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
-    gsl_rng_free(rng);
-    gsl_vector_free(x);
-    gsl_vector_free(y); 
-    gsl_vector_free (c); 
-    gsl_bspline_free(work);
+  if (!init_spectral(images, mask, plan, args, &sf)) return(SUCCESS);
+
+  n_chunk = (cell + SPECTRAL_CHUNK - 1) / SPECTRAL_CHUNK;
+
+  #pragma omp parallel private(work) shared(n_chunk,cell,sf) default(none)
+  {
+
+    alloc_spectral_work(&sf, &work);
+
+    #pragma omp for schedule(guided)  
+    for (chunk=0; chunk<n_chunk; chunk++){
+      apply_spectral(&sf, &work, chunk*SPECTRAL_CHUNK, 
+        (chunk*SPECTRAL_CHUNK+SPECTRAL_CHUNK > cell) ? cell-chunk*SPECTRAL_CHUNK : SPECTRAL_CHUNK);
+    }
+
+    free_spectral_work(&sf, &work);
 
   }
 
+  free_spectral(&sf);
+
 
   proctime_print("Spectral fit", TIME);
 
   
   return SUCCESS;
 }
+
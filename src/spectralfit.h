@@ -31,11 +31,14 @@ Enhance spatial resolution header
 #include <stdio.h>   // core input and output functions
 #include <stdlib.h>  // standard general utilities library
 #include <stdbool.h> // boolean data type
+#include <stdint.h>  // fixed-width integer types
 
 #include "dtype.h"
 #include "alloc.h"
 #include "utils.h"
 #include "table.h"
+#include "bandplan.h"
+#include "mask.h"
 
 
 
@@ -43,7 +46,58 @@ Enhance spatial resolution header
 extern "C" {
 #endif
 
-int spectral_fit(img_t *images, table_t *bandlist, args_t *args);
+// number of pixels processed at once
+#define SPECTRAL_CHUNK 4096
+
+// max. number of input bands for validity masks
+#define MASK_BANDS 64
+
+// operator cache: chunks of entries, max. number of chunks
+#define CACHE_CHUNK 256
+#define CACHE_NCHUNK 256
+
+typedef struct {
+  uint64_t mask;    // validity mask of input bands
+  bool ok;          // operator could be computed
+  double *M;        // nb_out x nb_in operator
+} cache_entry_t;
+
+typedef struct {
+  int n;                              // number of published entries
+  cache_entry_t *chunk[CACHE_NCHUNK]; // entries, never moved
+} operator_cache_t;
+
+typedef struct {
+  bandplan_t *plan;
+  args_t *args;
+  int nb_in, nb_out;       // number of input and output bands
+  bool partial;            // fit partially valid pixels
+  uint64_t full;           // mask of fully valid pixels
+  double *M;               // nb_out x nb_in operator
+  float **in, **out;       // input and output bands
+  float *nodata_in;        // nodata of input bands
+  float *nodata;           // nodata of output bands
+  mask_t *mask;            // validity mask
+  operator_cache_t cache;  // operators of partially valid pixels
+  int n_partial, n_failed; // partially valid pixels, fitted and failed
+} spectral_t;
+
+typedef struct {
+  int nb_out;
+  double **fit;            // fit of one chunk
+  double *pix;             // fit of one pixel
+  double *M;               // operator if the cache is full
+  uint64_t last;           // mask of last cache hit
+  double *M_last;          // operator of last cache hit
+  int n_partial, n_failed;
+} spectral_work_t;
+
+bool init_spectral(img_t *images, mask_t *mask, bandplan_t *plan, args_t *args, spectral_t *sf);
+void free_spectral(spectral_t *sf);
+void alloc_spectral_work(spectral_t *sf, spectral_work_t *work);
+void free_spectral_work(spectral_t *sf, spectral_work_t *work);
+void apply_spectral(spectral_t *sf, spectral_work_t *work, int p0, int np);
+int spectral_fit(img_t *images, mask_t *mask, bandplan_t *plan, args_t *args);
 
 #ifdef __cplusplus
 }
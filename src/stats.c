@@ -110,6 +110,79 @@ double oldcv = *cv;
 }
 
 
+/** One-pass covariance matrix estimation
++++ This function implements a one-pass estimation of the co-moment matrix
++++ (sum of cross-products of deviations from the mean) of several varia-
++++ bles based on recurrence formulas, i.e. the multivariate version of 
++++ cov_recurrence. Only the upper triangle is updated. Divide by n-1 to 
++++ get the covariance matrix. Use this function in a loop.
++++-----------------------------------------------------------------------
++++ P. P�bay. SANDIA REPORT SAND2008-6212 (2008). Formulas for Robust, 
++++ One-Pass Parallel Computation of Co- variances and Arbitrary-Order 
++++ Statistical Moments.
++++-----------------------------------------------------------------------
+--- x:      current values (nv)
+--- mx:     last estimate of means (is updated)
+--- cm:     last estimate of co-moment matrix, nv x nv (is updated)
+--- nv:     number of variables
+--- n:      number of observations
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void comoment_recurrence(const double *x, double *mx, double *cm, int nv, double n){
+int i, j;
+double w = (n-1)/n, di;
+
+  for (i=0; i<nv; i++){
+    di = w*(x[i]-mx[i]);
+    for (j=i; j<nv; j++) cm[i*nv+j] += di*(x[j]-mx[j]);
+  }
+
+  for (i=0; i<nv; i++) mx[i] += (x[i]-mx[i])/n;
+
+  return;
+}
+
+
+/** Merge co-moment matrices
++++ This function merges two one-pass estimates of means and co-moment 
++++ matrix (see comoment_recurrence), e.g. of two threads that processed
++++ different parts of the data. Estimate b is added to estimate a.
++++-----------------------------------------------------------------------
++++ P. P�bay. SANDIA REPORT SAND2008-6212 (2008). Formulas for Robust, 
++++ One-Pass Parallel Computation of Co- variances and Arbitrary-Order 
++++ Statistical Moments.
++++-----------------------------------------------------------------------
+--- mx_a:   means of a (is updated)
+--- cm_a:   co-moment matrix of a (is updated)
+--- n_a:    number of observations of a (is updated)
+--- mx_b:   means of b
+--- cm_b:   co-moment matrix of b
+--- n_b:    number of observations of b
+--- nv:     number of variables
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void comoment_merge(double *mx_a, double *cm_a, double *n_a, const double *mx_b, const double *cm_b, double n_b, int nv){
+int i, j;
+double n = *n_a + n_b, w;
+
+  if (n_b <= 0) return;
+
+  w = (*n_a)*n_b/n;
+
+  for (i=0; i<nv; i++){
+  for (j=i; j<nv; j++){
+    cm_a[i*nv+j] += cm_b[i*nv+j] + w*(mx_b[i]-mx_a[i])*(mx_b[j]-mx_a[j]);
+  }
+  }
+
+  for (i=0; i<nv; i++) mx_a[i] += (mx_b[i]-mx_a[i])*n_b/n;
+
+  *n_a = n;
+
+  return;
+}
+
+
 /** One-pass skewness and kurtosis estimation
 +++ This function implements a one-pass estimation of skewness and kurto-
 +++ sis based on recurrence formulas. It can be used to estimate mean of 
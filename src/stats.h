@@ -46,6 +46,8 @@ enum { _TAIL_LEFT_, _TAIL_TWO_, _TAIL_RIGHT_, _TAIL_LENGTH_ };
 
 void covar_recurrence(double   x, double   y, double *mx, double *my, double *vx, double *vy, double *cv, double n);
 void cov_recurrence(double   x, double   y, double *mx, double *my, double *cv, double n);
+void comoment_recurrence(const double *x, double *mx, double *cm, int nv, double n);
+void comoment_merge(double *mx_a, double *cm_a, double *n_a, const double *mx_b, const double *cm_b, double n_b, int nv);
 void kurt_recurrence(double   x,    double *mx, double *vx,    double *sx,double *kx, double n);
 void skew_recurrence(double   x,    double *mx, double *vx,    double *sx,double n);
 void var_recurrence(double   x, double *mx, double *vx, double n);
@@ -0,0 +1,461 @@
+/**+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+This file is part of FORCE - Framework for Operational Radiometric 
+Correction for Environmental monitoring.
+
+Copyright (C) 2013-2022 David Frantz
+
+FORCE is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+FORCE is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with FORCE.  If not, see <http://www.gnu.org/licenses/>.
+
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+
+
+/**+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+This file contains functions for out-of-core processing in row blocks
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+
+
+#include "stream.h"
+
+// bytes per pixel besides the float bands: validity mask (1/8), and
+// frozen neighbor validity of the resolution merge (1)
+#define STREAM_OVERHEAD 1.125
+
+// blocks in flight: one is read, one is computed, one is written
+#define STREAM_SLOTS 3
+
+// max. share of the memory budget for GDAL's block cache
+#define STREAM_CACHE 0.25
+
+
+typedef struct {
+  img_t images[IMGLEN];
+  int r0, r1;      // core rows
+  int s0, s1;      // rows incl. halo
+} block_t;
+
+typedef struct {
+  block_t *item[STREAM_SLOTS+1];
+  int head, n;
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+} queue_t;
+
+typedef struct {
+  GDALDatasetH *dataset; // inputs, used by reader only
+  GDALDatasetH file;     // output, used by writer only
+  img_t *scene;          // images with metadata of the full scene
+  bandplan_t *plan;
+  args_t *args;
+  int nrow, halo;        // rows per block, halo rows
+  queue_t empty;         // blocks that can be read into
+  queue_t full;          // blocks that were read
+  queue_t done;          // blocks that were computed
+  double stall_read;     // time that the reader waited for a block
+  double stall_compute;  // time that the compute team waited for input
+  double stall_write;    // time that the writer waited for output
+} pipeline_t;
+
+
+int block_rows(args_t *args, int row, int col, int nfloat, int halo, int nblock, int align);
+void free_block(img_t *images);
+void init_queue(queue_t *queue);
+void free_queue(queue_t *queue);
+void queue_push(queue_t *queue, block_t *block);
+block_t *queue_pop(queue_t *queue, double *stall);
+void *stream_reader(void *arg);
+void *stream_writer(void *arg);
+
+
+/** Number of rows per block
++++ This function computes how many rows fit into a block, such that the
++++ blocks in flight, incl. halo rows on both sides, and GDAL's block
++++ cache respect the memory budget. The rows are rounded down to whole
++++ GDAL blocks, with at least one block, such that no GDAL block is
++++ split between two row blocks.
+--- args:   arguments
+--- row:    number of rows of the scene
+--- col:    number of columns of the scene
+--- nfloat: number of float bands held per pixel
+--- halo:   number of halo rows on each side
+--- nblock: number of blocks in memory at the same time
+--- align:  height of GDAL blocks
++++ Return: number of rows per block
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int block_rows(args_t *args, int row, int col, int nfloat, int halo, int nblock, int align){
+double bytes_row = col * (4.0*nfloat + STREAM_OVERHEAD);
+double cache = (double)GDALGetCacheMax64();
+double budget = (args->memory * 1048576.0 - cache) / nblock;
+int nrow;
+
+
+  nrow = (int)(budget / bytes_row) - 2*halo;
+
+  if (nrow < 1){
+    printf("memory budget of %d MB is too small, at least %.0f MB are needed.\n",
+      args->memory, ceil((nblock*(1 + 2*halo)*bytes_row + cache) / 1048576.0));
+    exit(FAILURE);
+  }
+
+  if (align < 1) align = 1;
+  nrow = (nrow > align) ? nrow / align * align : align;
+
+  if (nrow > row) nrow = row;
+
+  return nrow;
+}
+
+
+/** Free block
++++ This function frees all images of a block, and resets them.
+--- images: images
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void free_block(img_t *images){
+int i;
+
+
+  for (i=0; i<IMGLEN; i++){
+    if (images[i].data == NULL) continue;
+    free_2D((void**)images[i].data, images[i].meta.dim.band);
+    images[i].data = NULL;
+  }
+
+  return;
+}
+
+
+/** Initialize queue
++++ This function initializes an empty, bounded queue of blocks.
+--- queue:  queue (returned)
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void init_queue(queue_t *queue){
+
+
+  queue->head = 0;
+  queue->n = 0;
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->cond, NULL);
+
+  return;
+}
+
+
+/** Free queue
+--- queue:  queue
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void free_queue(queue_t *queue){
+
+
+  pthread_mutex_destroy(&queue->lock);
+  pthread_cond_destroy(&queue->cond);
+
+  return;
+}
+
+
+/** Push block to queue
++++ This function appends a block to the queue, and waits if the queue is
++++ full. NULL marks the end of the stream.
+--- queue:  queue
+--- block:  block
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void queue_push(queue_t *queue, block_t *block){
+
+
+  pthread_mutex_lock(&queue->lock);
+
+  while (queue->n == STREAM_SLOTS+1) pthread_cond_wait(&queue->cond, &queue->lock);
+
+  queue->item[(queue->head + queue->n) % (STREAM_SLOTS+1)] = block;
+  queue->n++;
+
+  pthread_cond_broadcast(&queue->cond);
+  pthread_mutex_unlock(&queue->lock);
+
+  return;
+}
+
+
+/** Pop block from queue
++++ This function takes the first block from the queue, and waits if the
++++ queue is empty. The waiting time is added to the stall time.
+--- queue:  queue
+--- stall:  stall time in seconds (is updated)
++++ Return: block, or NULL at the end of the stream
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+block_t *queue_pop(queue_t *queue, double *stall){
+block_t *block = NULL;
+double t0 = omp_get_wtime();
+
+
+  pthread_mutex_lock(&queue->lock);
+
+  while (queue->n == 0) pthread_cond_wait(&queue->cond, &queue->lock);
+
+  block = queue->item[queue->head];
+  queue->head = (queue->head + 1) % (STREAM_SLOTS+1);
+  queue->n--;
+
+  pthread_cond_broadcast(&queue->cond);
+  pthread_mutex_unlock(&queue->lock);
+
+  *stall += omp_get_wtime() - t0;
+
+  return block;
+}
+
+
+/** Reader stage
++++ This thread reads the blocks, incl. halo rows, into empty slots, and
++++ passes them on to the compute team. It only waits if all slots are in
++++ use, i.e. reading is ahead of computing.
+--- arg:    pipeline
++++ Return: NULL
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void *stream_reader(void *arg){
+pipeline_t *pipe = (pipeline_t*)arg;
+int row = pipe->scene[HIGHRES].meta.dim.row;
+int r0;
+block_t *block = NULL;
+
+
+  for (r0=0; r0<row; r0+=pipe->nrow){
+
+    block = queue_pop(&pipe->empty, &pipe->stall_read);
+
+    block->r0 = r0;
+    block->r1 = (r0+pipe->nrow > row) ? row : r0+pipe->nrow;
+    block->s0 = (block->r0-pipe->halo < 0)   ? 0   : block->r0-pipe->halo;
+    block->s1 = (block->r1+pipe->halo > row) ? row : block->r1+pipe->halo;
+
+    memcpy(block->images, pipe->scene, IMGLEN*sizeof(img_t));
+
+    read_rows(pipe->dataset, block->images, pipe->plan, pipe->args, block->s0, block->s1-block->s0, true);
+
+    queue_push(&pipe->full, block);
+
+  }
+
+  queue_push(&pipe->full, NULL);
+
+  return NULL;
+}
+
+
+/** Writer stage
++++ This thread writes the core rows of the computed blocks, and returns
++++ the slots to the reader.
+--- arg:    pipeline
++++ Return: NULL
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void *stream_writer(void *arg){
+pipeline_t *pipe = (pipeline_t*)arg;
+block_t *block = NULL;
+
+
+  while ((block = queue_pop(&pipe->done, &pipe->stall_write)) != NULL){
+
+    // core rows only, halo rows belong to the neighboring blocks
+    write_rows(pipe->file, block->images, pipe->plan, pipe->args, 
+      block->r0, block->r0-block->s0, block->r1-block->r0);
+
+    free_block(block->images);
+
+    queue_push(&pipe->empty, block);
+
+  }
+
+  return NULL;
+}
+
+
+/** Out-of-core processing
++++ This function processes the scene in blocks of rows, such that only
++++ a few blocks need to be held in memory. First, the PCA statistics are
++++ accumulated over the whole scene (or over a decimated read, or the 
++++ PCA model is read from file). Then, each block is read with a halo of
++++ r^2 rows on both sides (the reach of the squared-offset kernel), pro-
++++ jected, sharpened, fitted, and its core rows are written. Thus, the 
++++ output is the same as when processing the full scene at once. Read-
++++ ing, computing and writing are pipelined: a reader thread prefetches
++++ block n+1, and a writer thread compresses block n-1, while the OpenMP
++++ team computes block n. Block sizes are chosen such that all blocks in
++++ flight fit the memory budget given with -M.
+--- images: images (empty, are used for scene metadata)
+--- plan:   band plan
+--- args:   arguments
++++ Return: SUCCESS/FAILURE
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+int stream_multisharp(img_t *images, bandplan_t *plan, args_t *args){
+pipeline_t pipe;
+pthread_t reader, writer;
+block_t *slot = NULL, *block = NULL;
+pca_model_t model;
+mask_t mask;
+meta_t scene;
+GIntBig cache;
+int k, nrow, r0, r1, nfloat, nblock = 0;
+int xblock, yblock_in, yblock_out, align;
+double t0, t_compute = 0;
+time_t TIME;
+
+
+  time(&TIME);
+
+  printf("Starting out-of-core processing, %d MB\n", args->memory);
+
+  // the results of these modes depend on the image extent
+  if (args->lowres > 1){
+    printf("-l is not available with -M.\n");
+    exit(FAILURE);
+  }
+
+  if (args->grid > 1){
+    printf("-g is not available with -M.\n");
+    exit(FAILURE);
+  }
+
+  if (strcmp(args->f_pca, "NULL") != 0){
+    printf("PCA file is not written with -M.\n");
+  }
+
+  // GDAL's block cache is part of the budget
+  cache = (GIntBig)(args->memory * 1048576.0 * STREAM_CACHE);
+  if (GDALGetCacheMax64() > cache) GDALSetCacheMax64(cache);
+
+  memset(&pipe, 0, sizeof(pipeline_t));
+
+  pipe.dataset = open_dataset(images, plan, args);
+
+  GDALGetBlockSize(GDALGetRasterBand(pipe.dataset[plan->highres_file[0]],
+    plan->highres_band[0]), &xblock, &yblock_in);
+
+  memcpy(&scene, &images[HIGHRES].meta, sizeof(meta_t));
+
+  init_pca_model(&model, scene.dim.band);
+
+
+  // statistics pass, unless the model is read from file
+  if (strcmp(args->f_pca_load, "NULL") != 0){
+    // statistics are skipped
+  } else if (args->decimate > 1){
+    read_decimated(images, plan, args);
+    alloc_mask(&mask, images[DECIMATED].meta.dim.cell);
+    mask_from_bands(&mask, images[DECIMATED].data, scene.dim.band, images[DECIMATED].meta.nodata);
+    pca_accumulate(&images[DECIMATED], &mask, 1, &model);
+    free_mask(&mask);
+    free_block(images);
+  } else {
+    nrow = block_rows(args, scene.dim.row, scene.dim.col, scene.dim.band, 0, 1, yblock_in);
+    for (r0=0; r0<scene.dim.row; r0+=nrow){
+      r1 = (r0+nrow > scene.dim.row) ? scene.dim.row : r0+nrow;
+      read_rows(pipe.dataset, images, plan, args, r0, r1-r0, false);
+      alloc_mask(&mask, images[HIGHRES].meta.dim.cell);
+      mask_from_bands(&mask, images[HIGHRES].data, scene.dim.band, images[HIGHRES].meta.nodata);
+      pca_accumulate(&images[HIGHRES], &mask, args->sample, &model);
+      free_mask(&mask);
+      free_block(images);
+    }
+    memcpy(&images[HIGHRES].meta, &scene, sizeof(meta_t));
+  }
+
+  pca_solve(&model, args);
+
+  proctime_print("statistics pass", TIME);
+
+
+  // highres, lowres, PCA, sharpened and spectral fit bands per pixel
+  nfloat = plan->n_highres + 2*plan->n_lowres + model.numcomp + plan->n_spectral;
+
+  pipe.scene = images;
+  pipe.plan  = plan;
+  pipe.args  = args;
+  pipe.halo  = args->radius*args->radius;
+
+  pipe.file = create_output(&scene, plan, args);
+
+  // whole output blocks, and whole input blocks if larger
+  GDALGetBlockSize(GDALGetRasterBand(pipe.file, 1), &xblock, &yblock_out);
+  align = (yblock_in > yblock_out && yblock_in % yblock_out == 0) ? yblock_in : yblock_out;
+
+  pipe.nrow  = block_rows(args, scene.dim.row, scene.dim.col, nfloat, pipe.halo, STREAM_SLOTS, align);
+
+  printf("%d rows per block, %d halo rows, %d blocks in flight\n",
+    pipe.nrow, pipe.halo, STREAM_SLOTS);
+
+  init_queue(&pipe.empty);
+  init_queue(&pipe.full);
+  init_queue(&pipe.done);
+
+  alloc((void**)&slot, STREAM_SLOTS, sizeof(block_t));
+  for (k=0; k<STREAM_SLOTS; k++) queue_push(&pipe.empty, &slot[k]);
+
+  if (pthread_create(&reader, NULL, stream_reader, &pipe) != 0 ||
+      pthread_create(&writer, NULL, stream_writer, &pipe) != 0){
+    printf("unable to start reader or writer thread.\n");
+    exit(FAILURE);
+  }
+
+  // compute stage
+  while ((block = queue_pop(&pipe.full, &pipe.stall_compute)) != NULL){
+
+    t0 = omp_get_wtime();
+
+    printf("block of rows %d-%d\n", block->r0, block->r1-1);
+
+    alloc_mask(&mask, block->images[HIGHRES].meta.dim.cell);
+    mask_from_bands(&mask, block->images[HIGHRES].data, scene.dim.band, block->images[HIGHRES].meta.nodata);
+
+    pca_project(block->images, &mask, &model);
+
+    resolution_merge(block->images, &mask, plan, args);
+
+    if (!args->fused) spectral_fit(block->images, &mask, plan, args);
+
+    free_mask(&mask);
+
+    t_compute += omp_get_wtime() - t0;
+    nblock++;
+
+    queue_push(&pipe.done, block);
+
+  }
+
+  queue_push(&pipe.done, NULL);
+
+  pthread_join(reader, NULL);
+  pthread_join(writer, NULL);
+
+  printf("%d blocks, compute %.1f s; stall: reader %.1f s, compute %.1f s, writer %.1f s\n",
+    nblock, t_compute, pipe.stall_read, pipe.stall_compute, pipe.stall_write);
+
+  free_queue(&pipe.empty);
+  free_queue(&pipe.full);
+  free_queue(&pipe.done);
+  free((void*)slot);
+
+  GDALClose(pipe.file);
+  close_dataset(pipe.dataset, args);
+
+  free_pca_model(&model);
+
+  proctime_print("out-of-core processing", TIME);
+
+  return SUCCESS;
+}
+
@@ -0,0 +1,63 @@
+/**+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+This file is part of FORCE - Framework for Operational Radiometric 
+Correction for Environmental monitoring.
+
+Copyright (C) 2013-2022 David Frantz
+
+FORCE is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+FORCE is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with FORCE.  If not, see <http://www.gnu.org/licenses/>.
+
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+
+/**+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+Out-of-core processing header
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdio.h>   // core input and output functions
+#include <stdlib.h>  // standard general utilities library
+#include <stdbool.h> // boolean data type
+#include <pthread.h> // POSIX threads
+#include <omp.h>     // multiprocessing
+
+/** Geospatial Data Abstraction Library (GDAL) **/
+#include "gdal.h"    // public (C callable) GDAL entry points
+
+#include "dtype.h"
+#include "alloc.h"
+#include "utils.h"
+#include "bandplan.h"
+#include "mask.h"
+#include "read.h"
+#include "pca.h"
+#include "resmerge.h"
+#include "spectralfit.h"
+#include "write.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int stream_multisharp(img_t *images, bandplan_t *plan, args_t *args);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
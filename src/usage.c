@@ -4,7 +4,7 @@
 void usage(char *exe, int exit_code){
 
 
-  printf("Usage: %s [-h] [-o] [-p] [-f] [-r] [-v] [-j] input-image input-bands\n", exe);
+  printf("Usage: %s [-h] [-o] [-p] [-P] [-L] [-D] [-M] [-f] [-r] [-m] [-t] [-g] [-l] [-a] [-b] [-F] [-q] [-v] [-j] [-i] input-image input-bands\n", exe);
   printf("\n");
   printf("  -h  = show this help\n");
   printf("\n");
@@ -12,24 +12,75 @@ void usage(char *exe, int exit_code){
   printf("     defaults to 'base_sharpened.tif'\n");
   printf("  -p pca-file = output file path of PCA transformation,\n");
   printf("     when not given, file is not written\n");
+  printf("  -P model-file = write PCA model (means, eigenvalues, eigenvectors,\n");
+  printf("     retained components) to csv table, for reuse with -L\n");
+  printf("  -L model-file = read PCA model from csv table, written with -P;\n");
+  printf("     statistics are skipped, -v and -s are ignored, e.g. for\n");
+  printf("     seamless processing of many tiles of one acquisition\n");
   printf("  -f format  = output format (GDAL vector driver short name)\n");
   printf("     defaults to GTiff\n");
   printf("  -v variance = how much percent of the PCA-variance should be retained for the target bands?\n");
   printf("     defaults to 99\n");
   printf("  -s sampling = sampling factor to speed up computation of PCA\n");
   printf("     defaults to 10\n");
+  printf("  -D factor = estimate PCA statistics from a factor x decimated read\n");
+  printf("     of the highres bands (GDAL overviews if available); -s is\n");
+  printf("     ignored then\n");
+  printf("     defaults to 1 (statistics from full resolution)\n");
+  printf("  -M memory = process the image out-of-core in blocks of rows, such\n");
+  printf("     that the blocks and GDAL's block cache (max. 1/4) fit into\n");
+  printf("     memory MB; rows are rounded down to whole GDAL blocks; the PCA\n");
+  printf("     statistics are accumulated over the whole image first; not with\n");
+  printf("     -l or -g, -p is ignored\n");
+  printf("     defaults to 0 (process the whole image in memory)\n");
   printf("  -r radius = how many neighboring cells to use for sharpening?\n");
   printf("     defaults to 2\n");
+  printf("  -m solver = regression engine for sharpening\n");
+  printf("     SVD:  factorize design matrix of each kernel\n");
+  printf("     GRAM: normal equations from separable kernel sums,\n");
+  printf("           cost does not grow with r^2, faster for larger radius\n");
+  printf("     defaults to SVD\n");
+  printf("  -t tilesize = tile size in pixels for the SVD solver\n");
+  printf("     defaults to auto (fit tile into L2 cache)\n");
+  printf("  -g step = fit regression only every step-th pixel (SVD solver),\n");
+  printf("     and interpolate coefficients bilinearly in between;\n");
+  printf("     not with -m GRAM or -a\n");
+  printf("     defaults to 1 (fit every pixel)\n");
+  printf("  -l factor = fit regression at native resolution of the lowres bands,\n");
+  printf("     which are factor times coarser than the highres bands, e.g. 2 for\n");
+  printf("     Sentinel-2 20m bands; lowres bands are block-averaged on reading,\n");
+  printf("     coefficients and residuals are interpolated to full resolution;\n");
+  printf("     not with -g, -m GRAM, -q or -a\n");
+  printf("     defaults to 1 (fit at full resolution)\n");
+  printf("  -a threshold = homogeneity threshold for the SVD solver: if the\n");
+  printf("     std. dev. of each lowres band within the kernel is below,\n");
+  printf("     the window mean is used instead of a regression;\n");
+  printf("     not with -m GRAM or -g\n");
+  printf("     defaults to 0 (always fit)\n");
+  printf("  -q = check fast solvers against SVD on a sample of pixels,\n");
+  printf("     with -g, print quality vs. grid step\n");
+  printf("  -b = spectral fit of pixels with some invalid bands, using the\n");
+  printf("     remaining bands; else such pixels are nodata\n");
+  printf("  -F = fuse spectral fit into resolution merge: each thread fits\n");
+  printf("     the pixels it has just sharpened, while they are in cache\n");
   printf("  -n nbreaks = number of breaks for B-Spline\n");
   printf("     defaults to 10\n");
   printf("  -d order = order of the B-Spline\n");
   printf("     defaults to 4\n");
   printf("  -j ncpu = How many CPUs to use?\n");
   printf("     defaults to all\n");
+  printf("  -i nio = How many threads to read the input with? Bands, and\n");
+  printf("     stripes of bands, are read in parallel; lower this for\n");
+  printf("     network filesystems\n");
+  printf("     defaults to ncpu\n");
   
   printf("\n");
   printf("  Positional arguments:\n");
   printf("  - input-image: well, the input image...\n");
+  printf("     or several, comma-separated images (e.g. one per resolution);\n");
+  printf("     highres bands must share one grid, lowres bands of coarser\n");
+  printf("     images are resampled to it on reading (nearest neighbor),\n");
+  printf("     or read as they are with -l\n");
   printf("  - input-bands: band definition\n");
   printf("     csv table [en], three (or more) named columns\n");
   printf("       band: band number\n");
@@ -38,7 +89,11 @@ void usage(char *exe, int exit_code){
   printf("         1: target band (highres)\n");
   printf("         2: spatial prediction band (lowres)\n");
   printf("         0: spectral prediction band (anyres)\n");
+  printf("         3: synthesized band, wavelength without input band\n");
+  printf("            (band number is ignored)\n");
   printf("        -1: ignore, bad band\n");
+  printf("       file: input image of the band (1-based), optional,\n");
+  printf("         defaults to 1\n");
   printf("\n");
 
   exit(exit_code);
@@ -49,23 +104,37 @@ void usage(char *exe, int exit_code){
 void parse_args(int argc, char *argv[], args_t *args){
 int opt;
 bool o = false, f = false, p = false;
+char buffer[STRLEN], *ptr = NULL;
 
 
   opterr = 0;
 
   // default parameters
   args->ncpu = omp_get_max_threads();
+  args->nio  = 0;
   args->radius = 2;
+  args->solver = SOLVER_SVD;
+  args->check  = false;
+  args->tile   = 0;
+  args->grid   = 1;
+  args->lowres = 1;
+  args->homogeneity = 0;
+  args->partial = false;
+  args->fused   = false;
   args->minvar = 0.99;
   args->sample = 10;
+  args->decimate = 1;
+  args->memory = 0;
   args->nbreak = 10;
   args->order  = 4;
   copy_string(args->f_output, STRLEN, "sharpened.tif");
   copy_string(args->f_pca, STRLEN, "NULL");
+  copy_string(args->f_pca_save, STRLEN, "NULL");
+  copy_string(args->f_pca_load, STRLEN, "NULL");
   copy_string(args->format, STRLEN, "GTiff");
 
   // optional parameters
-  while ((opt = getopt(argc, argv, "ho:f:j:r:v:p:s:n:d:")) != -1){
+  while ((opt = getopt(argc, argv, "ho:f:j:i:r:m:t:g:l:a:bFqv:p:P:L:D:M:s:n:d:")) != -1){
     switch(opt){
       case 'h':
         usage(argv[0], SUCCESS);
@@ -80,9 +149,55 @@ bool o = false, f = false, p = false;
       case 'j':
         args->ncpu = atoi(optarg);
         break;
+      case 'i':
+        args->nio = atoi(optarg);
+        if (args->nio < 1){
+          fprintf(stderr, "Number of I/O threads must be >= 1.\n");
+          usage(argv[0], FAILURE);
+        }
+        break;
       case 'r':
         args->radius = atoi(optarg);
         break;
+      case 'm':
+        if (strcmp(optarg, "SVD") == 0){
+          args->solver = SOLVER_SVD;
+        } else if (strcmp(optarg, "GRAM") == 0){
+          args->solver = SOLVER_GRAM;
+        } else {
+          fprintf(stderr, "Unknown solver %s.\n", optarg);
+          usage(argv[0], FAILURE);
+        }
+        break;
+      case 't':
+        args->tile = atoi(optarg);
+        break;
+      case 'g':
+        args->grid = atoi(optarg);
+        if (args->grid < 1){
+          fprintf(stderr, "Grid step must be >= 1.\n");
+          usage(argv[0], FAILURE);
+        }
+        break;
+      case 'l':
+        args->lowres = atoi(optarg);
+        if (args->lowres < 1){
+          fprintf(stderr, "Resolution factor must be >= 1.\n");
+          usage(argv[0], FAILURE);
+        }
+        break;
+      case 'a':
+        args->homogeneity = atof(optarg);
+        break;
+      case 'b':
+        args->partial = true;
+        break;
+      case 'F':
+        args->fused = true;
+        break;
+      case 'q':
+        args->check = true;
+        break;
       case 'v':
         args->minvar = atof(optarg)/100.0;
         break;
@@ -90,6 +205,26 @@ bool o = false, f = false, p = false;
         copy_string(args->f_pca, STRLEN, optarg);
         p = true;
         break;
+      case 'P':
+        copy_string(args->f_pca_save, STRLEN, optarg);
+        break;
+      case 'L':
+        copy_string(args->f_pca_load, STRLEN, optarg);
+        break;
+      case 'D':
+        args->decimate = atoi(optarg);
+        if (args->decimate < 1){
+          fprintf(stderr, "Decimation factor must be >= 1.\n");
+          usage(argv[0], FAILURE);
+        }
+        break;
+      case 'M':
+        args->memory = atoi(optarg);
+        if (args->memory < 1){
+          fprintf(stderr, "Memory budget must be >= 1 MB.\n");
+          usage(argv[0], FAILURE);
+        }
+        break;
       case 's':
         args->sample = atoi(optarg);
         break;
@@ -131,6 +266,23 @@ bool o = false, f = false, p = false;
     usage(argv[0], FAILURE);
   }
 
+  // input images, comma-separated
+  copy_string(buffer, STRLEN, args->f_input);
+  args->n_file = 0;
+
+  for (ptr = strtok(buffer, ","); ptr != NULL; ptr = strtok(NULL, ",")){
+    if (args->n_file == MAXFILE){
+      fprintf(stderr, "too many input images (max. %d).\n", MAXFILE);
+      usage(argv[0], FAILURE);
+    }
+    copy_string(args->f_file[args->n_file++], STRLEN, ptr);
+  }
+
+  if (args->n_file == 0){
+    fprintf(stderr, "no input image given.\n");
+    usage(argv[0], FAILURE);
+  }
+
   if ((!o && f) || (!f && o)){
     fprintf(stderr, "If -f is given, -o needs to be given, too.\n"); 
     usage(argv[0], FAILURE);
@@ -141,6 +293,27 @@ bool o = false, f = false, p = false;
     usage(argv[0], FAILURE);
   }
 
+  // the native-resolution fit has its own SVD regression
+  if (args->lowres > 1 && (args->grid > 1 || args->solver == SOLVER_GRAM || 
+      args->check || args->homogeneity > 0)){
+    fprintf(stderr, "-l cannot be combined with -g, -m GRAM, -q or -a.\n"); 
+    usage(argv[0], FAILURE);
+  }
+
+  // the grid fit and the homogeneity shortcut are SVD only
+  if (args->solver == SOLVER_GRAM && (args->grid > 1 || args->homogeneity > 0)){
+    fprintf(stderr, "-m GRAM cannot be combined with -g or -a.\n"); 
+    usage(argv[0], FAILURE);
+  }
+
+  // the grid fit has no homogeneity shortcut
+  if (args->grid > 1 && args->homogeneity > 0){
+    fprintf(stderr, "-g cannot be combined with -a.\n"); 
+    usage(argv[0], FAILURE);
+  }
+
+  if (args->nio == 0) args->nio = args->ncpu;
+
   return;
 }
 
@@ -68,22 +68,21 @@ time_t TIME;
 }
 
 
-int write_output(img_t *images, table_t *bandlist, args_t *args){
+/** Create output file
++++ This function creates the output file for the full scene, with one 
++++ band per output band of the band plan, and sets its georeference and
++++ nodata value. The data is written with write_rows.
+--- meta:   metadata of the full scene
+--- plan:   band plan
+--- args:   arguments
++++ Return: dataset handle
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+GDALDatasetH create_output(meta_t *meta, bandplan_t *plan, args_t *args){
 GDALDatasetH file = NULL;
 GDALRasterBandH band = NULL;
 GDALDriverH driver = NULL;
 char **options = NULL;
-int b_list, b_highres, b_sharpened, b_spectralfit, b_output;
-int col_use;
-time_t TIME;
-
-  
-  time(&TIME);
-
-
-  printf("Starting Image Write\n")  ;
-
-  col_use  = find_table_col(bandlist, "use");
+int b;
 
 
   if ((driver = GDALGetDriverByName(args->format)) == NULL){
@@ -99,69 +98,79 @@ time_t TIME;
     options = CSLSetNameValue(options, "BIGTIFF", "YES");
   }
 
-  if ((file = GDALCreate(driver, args->f_output, images[HIGHRES].meta.dim.col, images[HIGHRES].meta.dim.row, images[HIGHRES].meta.dim.band+images[SHARPENED].meta.dim.band+images[SPECTRALFIT].meta.dim.band, GDT_Int16, options)) == NULL){
+  if ((file = GDALCreate(driver, args->f_output, meta->dim.col, meta->dim.row, plan->nb_out, GDT_Int16, options)) == NULL){
     printf("Error creating file %s. ", args->f_output);
     exit(FAILURE);
   }
 
-  for (b_list=0, b_highres=0, b_sharpened=0, b_spectralfit=0, b_output=1; b_list<bandlist->nrow; b_list++){
+  CSLDestroy(options);
 
-    if ((int)bandlist->data[b_list][col_use] == 1){
+  for (b=0; b<plan->nb_out; b++){
+    band = GDALGetRasterBand(file, b+1);
+    GDALSetDescription(band, "band name here");
+    GDALSetRasterNoDataValue(band, meta->nodata);
+  }
 
-      band = GDALGetRasterBand(file, b_output++);
+  #pragma omp critical
+  {
+    GDALSetGeoTransform(file, meta->transformation);
+    GDALSetProjection(file, meta->projection);
+  }
 
-      if (GDALRasterIO(band, GF_Write, 0, 0, 
-            images[HIGHRES].meta.dim.col, images[HIGHRES].meta.dim.row, images[HIGHRES].data[b_highres++], 
-            images[HIGHRES].meta.dim.col, images[HIGHRES].meta.dim.row, GDT_Float32, 0, 0) == CE_Failure){
-        printf("Unable to write a band into %s. ", args->f_output);
-        exit(FAILURE);
-      }
+  return file;
+}
 
-      GDALSetDescription(band, "band name here");
-      GDALSetRasterNoDataValue(band, images[HIGHRES].meta.nodata);
 
-    } else if ((int)bandlist->data[b_list][col_use] == 2){
+/** Write a window of rows
++++ This function writes rows i0 to i0+nrow-1 of the images to rows r0 to
++++ r0+nrow-1 of the output file, in bandlist order.
+--- file:   dataset handle of output file
+--- images: images
+--- plan:   band plan
+--- args:   arguments
+--- r0:     first row in output file
+--- i0:     first row in images
+--- nrow:   number of rows
++++ Return: void
++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++**/
+void write_rows(GDALDatasetH file, img_t *images, bandplan_t *plan, args_t *args, int r0, int i0, int nrow){
+GDALRasterBandH band = NULL;
+int b, col = images[HIGHRES].meta.dim.col;
 
-      band = GDALGetRasterBand(file, b_output++);
 
-      if (GDALRasterIO(band, GF_Write, 0, 0, 
-            images[HIGHRES].meta.dim.col, images[HIGHRES].meta.dim.row, images[SHARPENED].data[b_sharpened++], 
-            images[HIGHRES].meta.dim.col, images[HIGHRES].meta.dim.row, GDT_Float32, 0, 0) == CE_Failure){
-        printf("Unable to write a band into %s. ", args->f_output);
-        exit(FAILURE);
-      }
+  for (b=0; b<plan->nb_out; b++){
 
-      GDALSetDescription(band, "band name here");
-      GDALSetRasterNoDataValue(band, images[HIGHRES].meta.nodata);
+    band = GDALGetRasterBand(file, b+1);
 
-    } else if  ((int)bandlist->data[b_list][col_use] == 0){
+    if (GDALRasterIO(band, GF_Write, 0, r0, col, nrow, 
+          images[plan->out_image[b]].data[plan->out_index[b]] + (size_t)i0*col, 
+          col, nrow, GDT_Float32, 0, 0) == CE_Failure){
+      printf("Unable to write a band into %s. ", args->f_output);
+      exit(FAILURE);
+    }
 
-      band = GDALGetRasterBand(file, b_output++);
+  }
 
-      if (GDALRasterIO(band, GF_Write, 0, 0, 
-            images[HIGHRES].meta.dim.col, images[HIGHRES].meta.dim.row, images[SPECTRALFIT].data[b_spectralfit++], 
-            images[HIGHRES].meta.dim.col, images[HIGHRES].meta.dim.row, GDT_Float32, 0, 0) == CE_Failure){
-        printf("Unable to write a band into %s. ", args->f_output);
-        exit(FAILURE);
-      }
+  return;
+}
 
-      GDALSetDescription(band, "band name here");
-      GDALSetRasterNoDataValue(band, images[HIGHRES].meta.nodata);
 
-    }
-    
-  }
+int write_output(img_t *images, bandplan_t *plan, args_t *args){
+GDALDatasetH file = NULL;
+time_t TIME;
 
+  
+  time(&TIME);
 
-  #pragma omp critical
-  {
-    GDALSetGeoTransform(file, images[HIGHRES].meta.transformation);
-    GDALSetProjection(file, images[HIGHRES].meta.projection);
-  }
 
-  GDALClose(file);
+  printf("Starting Image Write\n")  ;
 
-  CSLDestroy(options);
+
+  file = create_output(&images[HIGHRES].meta, plan, args);
+
+  write_rows(file, images, plan, args, 0, 0, images[HIGHRES].meta.dim.row);
+
+  GDALClose(file);
 
   proctime_print("writing", TIME);
 
@@ -15,9 +15,12 @@ extern "C" {
 
 #include "dtype.h"
 #include "table.h"
+#include "bandplan.h"
 
 int write_pca(img_t *images, args_t *args);
-int write_output(img_t *images, table_t *bandlist, args_t *args);
+GDALDatasetH create_output(meta_t *meta, bandplan_t *plan, args_t *args);
+void write_rows(GDALDatasetH file, img_t *images, bandplan_t *plan, args_t *args, int r0, int i0, int nrow);
+int write_output(img_t *images, bandplan_t *plan, args_t *args);
 
 #ifdef __cplusplus
 }